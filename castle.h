@@ -398,6 +398,50 @@ uint32_t castle_key_bytes_needed(int dims, const int *key_lens, const uint8_t *
 
 castle_key *castle_malloc_key(int dims, const int *key_lens, const uint8_t * const*keys, const uint8_t *key_flags) __attribute__((malloc));
 
+/* Builds keys a dimension at a time into one reusable buffer, see castle_key.c */
+typedef struct castle_key_builder
+{
+    char              *buf;
+    uint32_t           size;
+    uint32_t           used;
+    uint32_t           nr_dims;
+    uint32_t           dim;         /**< Next dimension to append */
+    int                kind;
+    castle_connection *conn;
+} castle_key_builder;
+
+int castle_key_builder_init(castle_key_builder *builder, void *buf, uint32_t size) __attribute__((warn_unused_result));
+int castle_key_builder_init_shared(castle_key_builder *builder, castle_connection *conn, uint32_t size) __attribute__((warn_unused_result));
+void castle_key_builder_destroy(castle_key_builder *builder);
+int castle_key_builder_reset(castle_key_builder *builder, uint32_t nr_dims) __attribute__((warn_unused_result));
+int castle_key_builder_append(castle_key_builder *builder, const void *data, uint32_t len, uint8_t flags) __attribute__((warn_unused_result));
+int castle_key_builder_finish(castle_key_builder *builder, castle_key **key_out, uint32_t *key_len_out) __attribute__((warn_unused_result));
+
+/* Key ordering, hashing and sorting, see castle_key.c */
+int castle_key_compare(const castle_key *a, const castle_key *b) __attribute__((pure));
+uint64_t castle_key_hash(const castle_key *key, uint64_t seed) __attribute__((pure));
+void castle_key_sort(castle_key **keys, size_t n);
+
+/* Order-preserving typed encodings for key dimensions, see castle_key_codec.c */
+uint32_t castle_key_encode_u64(uint8_t *out, uint64_t v);
+uint32_t castle_key_encode_i64(uint8_t *out, int64_t v);
+uint32_t castle_key_encode_u32(uint8_t *out, uint32_t v);
+uint32_t castle_key_encode_i32(uint8_t *out, int32_t v);
+uint32_t castle_key_encode_double(uint8_t *out, double v);
+uint32_t castle_key_encoded_string_len(const void *s, uint32_t len) __attribute__((pure));
+uint32_t castle_key_encode_string(uint8_t *out, const void *s, uint32_t len);
+uint32_t castle_key_encode_binary(uint8_t *out, const void *data, uint32_t len);
+void castle_key_encode_u64_batch(uint8_t *out, const uint64_t *v, size_t n);
+void castle_key_encode_i64_batch(uint8_t *out, const int64_t *v, size_t n);
+void castle_key_encode_double_batch(uint8_t *out, const double *v, size_t n);
+int castle_key_decode_u64(const uint8_t **p, const uint8_t *end, uint64_t *v);
+int castle_key_decode_i64(const uint8_t **p, const uint8_t *end, int64_t *v);
+int castle_key_decode_u32(const uint8_t **p, const uint8_t *end, uint32_t *v);
+int castle_key_decode_i32(const uint8_t **p, const uint8_t *end, int32_t *v);
+int castle_key_decode_double(const uint8_t **p, const uint8_t *end, double *v);
+int castle_key_decode_string(const uint8_t **p, const uint8_t *end, void *out, uint32_t out_len, uint32_t *len);
+int castle_key_decode_binary(const uint8_t **p, const uint8_t *end, void *out, uint32_t len);
+
 #define castle_key_length(_key)         ( !(_key) ? 0 : ( (_key)->length + 4 ) )
 
 extern uint32_t castle_key_dims(const castle_key *key) __attribute__((always_inline));
@@ -420,6 +464,11 @@ ONLY_INLINE uint8_t castle_key_elem_flags(const castle_key *key, int elem) {
   return castle_object_btree_key_dim_flags_get(key, (uint32_t)elem);
 }
 
+/* Read a dimension holding a single typed field, see castle_key_codec.c */
+int castle_key_elem_u64(const castle_key *key, int elem, uint64_t *v);
+int castle_key_elem_i64(const castle_key *key, int elem, int64_t *v);
+int castle_key_elem_double(const castle_key *key, int elem, double *v);
+
 int castle_key_copy        (castle_key *key, void *buf, uint32_t key_len);
 
 int castle_get             (castle_connection *conn,
@@ -442,6 +491,125 @@ int castle_timestamped_remove(castle_connection *conn,
                               castle_collection collection,
                               castle_key *key,
                               castle_user_timestamp_t u_ts);
+
+/* Write-behind - buffer and coalesce castle_replace()/castle_remove() on a connection */
+int castle_write_behind_enable(castle_connection *conn,
+                               unsigned int max_keys,
+                               uint64_t max_bytes,
+                               unsigned int max_delay_ms) __attribute__((warn_unused_result));
+int castle_write_behind_flush(castle_connection *conn);
+int castle_write_behind_disable(castle_connection *conn);
+
+/* Process-wide read cache for castle_get() */
+struct castle_read_cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t fills;
+    uint64_t stale_fills;   /**< Fills dropped because of a racing write        */
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t bytes;         /**< Currently cached                               */
+};
+int castle_read_cache_enable(uint64_t max_bytes, unsigned int ttl_ms) __attribute__((warn_unused_result));
+void castle_read_cache_disable(void);
+void castle_read_cache_stats_get(struct castle_read_cache_stats *stats);
+
+/* Coalesce concurrent castle_get() calls for the same key across the process */
+struct castle_single_flight_stats
+{
+    uint64_t fetches;       /**< Gets sent to the kernel                        */
+    uint64_t coalesced;     /**< Gets which waited for another's result         */
+};
+int castle_single_flight_enable(void) __attribute__((warn_unused_result));
+void castle_single_flight_disable(void);
+void castle_single_flight_stats_get(struct castle_single_flight_stats *stats);
+
+/* Asynchronous variants - callbacks run on the connection's response thread */
+typedef void (*castle_async_callback)(castle_connection *conn, int err, void *userdata);
+/* value points into a shared buffer and is only valid during the callback */
+typedef void (*castle_get_callback)  (castle_connection *conn, int err,
+                                      const char *value, uint64_t value_len, void *userdata);
+int castle_get_async       (castle_connection *conn,
+                            castle_collection collection,
+                            castle_key *key,
+                            uint32_t max_value_len,
+                            castle_get_callback callback,
+                            void *userdata) __attribute__((warn_unused_result));
+int castle_replace_async   (castle_connection *conn,
+                            castle_collection collection,
+                            castle_key *key,
+                            char *val, uint32_t val_len,
+                            castle_async_callback callback,
+                            void *userdata) __attribute__((warn_unused_result));
+int castle_timestamped_replace_async(castle_connection *conn,
+                                     castle_collection collection,
+                                     castle_key *key,
+                                     char *val, uint32_t val_len,
+                                     castle_user_timestamp_t u_ts,
+                                     castle_async_callback callback,
+                                     void *userdata) __attribute__((warn_unused_result));
+int castle_remove_async    (castle_connection *conn,
+                            castle_collection collection,
+                            castle_key *key,
+                            castle_async_callback callback,
+                            void *userdata) __attribute__((warn_unused_result));
+int castle_timestamped_remove_async(castle_connection *conn,
+                                    castle_collection collection,
+                                    castle_key *key,
+                                    castle_user_timestamp_t u_ts,
+                                    castle_async_callback callback,
+                                    void *userdata) __attribute__((warn_unused_result));
+
+struct castle_get_result
+{
+    int       err;
+    char     *value;         /**< Points into the arena returned by castle_get_multi */
+    uint32_t  value_len;
+};
+int castle_get_multi       (castle_connection *conn,
+                            castle_collection collection,
+                            castle_key **keys,
+                            unsigned int count,
+                            struct castle_get_result *results,
+                            char **arena_out) __attribute__((warn_unused_result));
+
+enum {
+    CASTLE_WRITE_REPLACE = 0,
+    CASTLE_WRITE_TIMESTAMPED_REPLACE,
+    CASTLE_WRITE_REMOVE,
+    CASTLE_WRITE_TIMESTAMPED_REMOVE,
+    CASTLE_WRITE_COUNTER_SET,
+    CASTLE_WRITE_COUNTER_ADD,
+};
+
+struct castle_write_op
+{
+    uint8_t                  type;            /**< CASTLE_WRITE_*                          */
+    castle_collection        collection;
+    castle_key              *key;
+    const char              *value;           /**< Unused by removes                       */
+    uint32_t                 value_len;
+    castle_user_timestamp_t  user_timestamp;  /**< Only used by timestamped operations     */
+};
+int castle_write_multi     (castle_connection *conn,
+                            const struct castle_write_op *ops,
+                            unsigned int count,
+                            int *errs);
+
+/* Counter accumulators - deltas are summed per key and written in batches */
+typedef struct castle_counter_acc castle_counter_acc;
+int castle_counter_acc_create(castle_connection *conn,
+                              unsigned int max_keys,
+                              unsigned int max_delay_ms,
+                              castle_counter_acc **acc_out) __attribute__((warn_unused_result));
+int castle_counter_acc_add (castle_counter_acc *acc,
+                            castle_collection collection,
+                            castle_key *key,
+                            int64_t delta);
+int castle_counter_acc_flush(castle_counter_acc *acc);
+int castle_counter_acc_destroy(castle_counter_acc *acc);
+
 int castle_iter_start      (castle_connection *conn,
                             castle_collection collection,
                             castle_key *start_key,
@@ -457,6 +625,144 @@ int castle_iter_next       (castle_connection *conn,
                             int *more) __attribute__((warn_unused_result));
 int castle_iter_finish     (castle_connection *conn,
                             castle_token token);
+int castle_iter_start_flags(castle_connection *conn,
+                            castle_collection collection,
+                            castle_key *start_key,
+                            castle_key *end_key,
+                            castle_token *token_out,
+                            struct castle_key_value_list **kvs,
+                            uint32_t buf_size,
+                            int *more,
+                            uint8_t flags) __attribute__((warn_unused_result));
+int castle_iter_next_flags (castle_connection *conn,
+                            castle_token token,
+                            struct castle_key_value_list **kvs,
+                            uint32_t buf_size,
+                            int *more,
+                            uint8_t flags) __attribute__((warn_unused_result));
+
+/* Filter pushdown - entries are tested in the iterator buffer, and only those
+ * the predicate accepts (returns non-zero for) are copied out or returned.
+ * Out-of-line values are tested before they are fetched: for those, val->type
+ * is CASTLE_VALUE_TYPE_OUT_OF_LINE, val->length is valid but val->val is not
+ * (it holds the value's collection_id), so the predicate must decide on the
+ * key, length and timestamp alone.  castle_iter_*_filter() then fetch values
+ * only for the entries accepted; cursors never fetch them. */
+typedef int (*castle_filter_fn)(castle_key *key,
+                                struct castle_iter_val *val,
+                                castle_user_timestamp_t timestamp,
+                                void *userdata);
+struct castle_iter_filter
+{
+    castle_filter_fn fn;
+    void            *userdata;
+    uint64_t         scanned;   /**< Entries tested                                 */
+    uint64_t         emitted;   /**< Entries accepted                               */
+};
+int castle_iter_start_filter(castle_connection *conn,
+                             castle_collection collection,
+                             castle_key *start_key,
+                             castle_key *end_key,
+                             castle_token *token_out,
+                             struct castle_key_value_list **kvs,
+                             uint32_t buf_size,
+                             int *more,
+                             uint8_t flags,
+                             struct castle_iter_filter *filter) __attribute__((warn_unused_result));
+int castle_iter_next_filter(castle_connection *conn,
+                            castle_token token,
+                            struct castle_key_value_list **kvs,
+                            uint32_t buf_size,
+                            int *more,
+                            uint8_t flags,
+                            struct castle_iter_filter *filter) __attribute__((warn_unused_result));
+
+/* Iterator traffic on a connection, counted by castle_iter_*, castle_getslice
+ * and cursors (and so the scans built on them) */
+struct castle_iter_stats
+{
+    uint64_t round_trips;   /**< ITER_START/ITER_NEXT requests completed      */
+    uint64_t entries;       /**< Key/value pairs returned                       */
+    uint64_t bytes;         /**< Key and inline value bytes returned            */
+};
+void castle_iter_stats_get (castle_connection *conn,
+                            struct castle_iter_stats *stats);
+
+/* Iterator cursors - zero-copy views of the entries in the iterator buffer */
+typedef struct castle_cursor castle_cursor;
+int castle_cursor_start    (castle_connection *conn,
+                            castle_collection collection,
+                            castle_key *start_key,
+                            castle_key *end_key,
+                            uint32_t buf_size,
+                            uint8_t flags,
+                            castle_cursor **cursor_out) __attribute__((warn_unused_result));
+int castle_cursor_prefetch (castle_cursor *cursor, unsigned int depth);
+int castle_cursor_grow     (castle_cursor *cursor, uint32_t max_size);
+int castle_cursor_next     (castle_cursor *cursor,
+                            struct castle_key_value_list **kv_out) __attribute__((warn_unused_result));
+int castle_cursor_seek     (castle_cursor *cursor,
+                            castle_key *key) __attribute__((warn_unused_result));
+void castle_cursor_set_filter(castle_cursor *cursor,
+                            struct castle_iter_filter *filter);
+int castle_cursor_finish   (castle_cursor *cursor);
+
+/* Parallel scans - one cursor per sub-range, each on its own connection */
+#define CASTLE_SCAN_ORDERED 1   /**< Deliver keys in order, one worker at a time */
+typedef int (*castle_scan_fn)(unsigned int worker, struct castle_key_value_list *kv, void *userdata);
+int castle_parallel_scan   (castle_collection collection,
+                            castle_key *start_key,
+                            castle_key *end_key,
+                            castle_key **split_keys,
+                            unsigned int nr_workers,
+                            uint8_t flags,
+                            unsigned int scan_flags,
+                            castle_scan_fn callback,
+                            void *userdata);
+
+/* Keys-only scans - values are never sent by the kernel */
+typedef int (*castle_key_fn)(castle_key *key, void *userdata);
+int castle_scan_keys       (castle_connection *conn,
+                            castle_collection collection,
+                            castle_key *start_key,
+                            castle_key *end_key,
+                            castle_key_fn callback,
+                            void *userdata) __attribute__((warn_unused_result));
+int castle_count_range     (castle_connection *conn,
+                            castle_collection collection,
+                            castle_key *start_key,
+                            castle_key *end_key,
+                            uint64_t *count_out) __attribute__((warn_unused_result));
+
+/* Hyper-rectangle queries - keys whose every dimension lies within per-dimension bounds */
+typedef int (*castle_kv_fn)(struct castle_key_value_list *kv, void *userdata);
+int castle_box_query       (castle_connection *conn,
+                            castle_collection collection,
+                            castle_key *lo,
+                            castle_key *hi,
+                            uint8_t flags,
+                            castle_kv_fn callback,
+                            void *userdata,
+                            uint64_t *restarts_out) __attribute__((warn_unused_result));
+
+/* Prefix scans - keys matching the first nr_fixed dimensions of a prefix key */
+typedef int (*castle_prefix_fn)(unsigned int index, struct castle_key_value_list *kv, void *userdata);
+int castle_prefix_scan     (castle_connection *conn,
+                            castle_collection collection,
+                            castle_key *prefix,
+                            uint32_t nr_fixed,
+                            uint8_t flags,
+                            castle_prefix_fn callback,
+                            void *userdata) __attribute__((warn_unused_result));
+int castle_prefix_scan_multi(castle_connection *conn,
+                            castle_collection collection,
+                            castle_key **prefixes,
+                            unsigned int nr_prefixes,
+                            uint32_t nr_fixed,
+                            uint8_t flags,
+                            castle_prefix_fn callback,
+                            void *userdata) __attribute__((warn_unused_result));
+
 int castle_getslice        (castle_connection *conn,
                             castle_collection collection,
                             castle_key *start_key,
@@ -472,6 +778,38 @@ int castle_big_put         (castle_connection *conn,
 int castle_put_chunk       (castle_connection *conn,
                             castle_token token,
                             char *value, uint32_t value_len);
+/* Source for streamed values: returns the number of bytes read into buf, 0 at
+ * end of input, or a negative errno */
+typedef ssize_t (*castle_read_fn)(void *data, char *buf, size_t len);
+int castle_big_put_stream  (castle_connection *conn,
+                            castle_collection collection,
+                            castle_key *key,
+                            castle_read_fn reader,
+                            void *reader_data,
+                            uint64_t val_length);
+int castle_big_put_fd      (castle_connection *conn,
+                            castle_collection collection,
+                            castle_key *key,
+                            int fd,
+                            uint64_t val_length);
+
+/* Bulk loading of sorted records through STREAM_IN */
+typedef struct castle_bulk_loader castle_bulk_loader;
+uint64_t castle_bulk_load_value_pages(uint64_t value_len);
+uint32_t castle_bulk_load_chunks(uint64_t pages);
+int castle_bulk_load_start (castle_connection *conn,
+                            castle_collection collection,
+                            uint64_t entries_count,
+                            uint32_t medium_object_chunks,
+                            castle_bulk_loader **loader_out) __attribute__((warn_unused_result));
+int castle_bulk_load_add   (castle_bulk_loader *loader,
+                            castle_key *key,
+                            const char *value,
+                            uint64_t value_len,
+                            castle_user_timestamp_t timestamp,
+                            uint8_t type) __attribute__((warn_unused_result));
+int castle_bulk_load_finish(castle_bulk_loader *loader, int abort);
+
 int castle_big_get         (castle_connection *conn,
                             castle_collection collection,
                             castle_key *key,
@@ -479,6 +817,11 @@ int castle_big_get         (castle_connection *conn,
 int castle_get_chunk       (castle_connection *conn,
                             castle_token token,
                             char **value_out, uint32_t *value_len_out) __attribute__((warn_unused_result));
+int castle_big_get_to_fd   (castle_connection *conn,
+                            castle_collection collection,
+                            castle_key *key,
+                            int fd,
+                            uint64_t *value_len_out) __attribute__((warn_unused_result));
 
 /* Control functions - ioctls */
 
@@ -7,9 +7,11 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "castle.h"
+#include "castle_private.h"
 
 #define castle_key_header_size(_nr_dims) castle_object_btree_key_header_size(_nr_dims)
 
@@ -90,14 +92,66 @@ castle_malloc_key(int dims, const int *key_lens, const uint8_t * const*keys, con
   return key;
 }
 
-static int make_key_buffer(castle_connection *conn, castle_key *key, uint32_t extra_space, char **key_buf_out, uint32_t *key_len_out) {
+/*
+ * Whether key is laid out exactly as castle_build_key() would lay it out: the
+ * payload starting straight after the dim_head array, each dimension following
+ * the last, and the final one ending at the end of the key.  Such a key can be
+ * copied with memcpy().
+ */
+static int castle_key_contiguous(castle_key *key) {
+  uint32_t dims = key->nr_dims;
+  uint32_t end = key->length + 4;
+  uint32_t offset, prev;
+
+  if (dims == 0)
+    return end == castle_key_header_size(0);
+
+  prev = KEY_DIMENSION_OFFSET(key->dim_head[0]);
+  if (prev != castle_key_header_size(dims))
+    return 0;
+
+  for (uint32_t i = 1; i < dims; i++) {
+    offset = KEY_DIMENSION_OFFSET(key->dim_head[i]);
+    if (offset < prev)
+      return 0;
+    prev = offset;
+  }
+
+  return prev <= end;
+}
+
+/* Number of bytes needed to hold a copy of key in a buffer. */
+uint32_t castle_key_buffer_len(castle_key *key) {
+  int dims = key->nr_dims;
+  uint32_t key_len = castle_key_header_size(dims);
+
+  if (castle_key_contiguous(key))
+    return castle_key_length(key);
+
+  for (int i = 0; i < dims; i++)
+    key_len += castle_key_elem_len(key, i);
+
+  return key_len;
+}
+
+/* Copy a key castle_key_contiguous() has accepted. */
+static void castle_key_copy_contiguous(castle_key *key, char *key_buf, uint32_t key_len) {
+  memcpy(key_buf, key, key_len);
+  /* castle_build_key() zeroes these, so keep the copy byte-identical. */
+  memset(((castle_key *)key_buf)->_unused, 0, sizeof(key->_unused));
+}
+
+/* Copy key into key_buf, which must be at least castle_key_buffer_len(key) bytes. */
+void castle_key_buffer_fill(castle_key *key, char *key_buf, uint32_t key_len) {
+  if (key_len == castle_key_length(key) && castle_key_contiguous(key)) {
+    castle_key_copy_contiguous(key, key_buf, key_len);
+    return;
+  }
+
   int dims = key->nr_dims;
   int lens[dims];
   const uint8_t *keys[dims];
   uint8_t flags[dims];
-  char *key_buf;
-  uint32_t key_len;
-  int err;
 
   for (int i = 0; i < dims; i++) {
     lens[i] = castle_key_elem_len(key, i);
@@ -105,12 +159,6 @@ static int make_key_buffer(castle_connection *conn, castle_key *key, uint32_t ex
     flags[i] = castle_key_elem_flags(key, i);
   }
 
-  key_len = castle_key_bytes_needed(dims, lens, NULL, NULL);
-
-  err = castle_shared_buffer_create(conn, &key_buf, key_len + extra_space);
-  if (err)
-    return err;
-
   {
     int r = castle_build_key((castle_key *)key_buf, key_len, dims, lens,
                              (const uint8_t *const *)keys, flags);
@@ -118,60 +166,53 @@ static int make_key_buffer(castle_connection *conn, castle_key *key, uint32_t ex
       /* impossible */
       abort();
   }
+}
+
+static int make_key_buffer(castle_connection *conn, castle_key *key, uint32_t extra_space, char **key_buf_out, uint32_t *key_len_out) {
+  char *key_buf;
+  uint32_t key_len;
+  int contiguous = castle_key_contiguous(key);
+  int err;
+
+  key_len = contiguous ? castle_key_length(key) : castle_key_buffer_len(key);
+
+  err = castle_shared_buffer_create(conn, &key_buf, key_len + extra_space);
+  if (err)
+    return err;
+
+  if (contiguous)
+    castle_key_copy_contiguous(key, key_buf, key_len);
+  else
+    castle_key_buffer_fill(key, key_buf, key_len);
 
   *key_buf_out = key_buf;
   *key_len_out = key_len;
   return 0;
 }
 
-static int make_2key_buffer(castle_connection *conn, castle_key *key1, castle_key *key2, char **key_buf_out, uint32_t *key1_len_out, uint32_t *key2_len_out) {
-  int dims1 = key1->nr_dims;
-  int dims2 = key2->nr_dims;
-  int lens1[dims1];
-  int lens2[dims2];
-  const uint8_t *keys1[dims1];
-  const uint8_t *keys2[dims2];
-  uint8_t flags1[dims1];
-  uint8_t flags2[dims2];
+int castle_make_2key_buffer(castle_connection *conn, castle_key *key1, castle_key *key2, char **key_buf_out, uint32_t *key1_len_out, uint32_t *key2_len_out) {
   char *key_buf;
   uint32_t key1_len;
   uint32_t key2_len;
+  int contiguous1 = castle_key_contiguous(key1);
+  int contiguous2 = castle_key_contiguous(key2);
   int err;
 
-  for (int i = 0; i < dims1; i++) {
-    lens1[i] = castle_key_elem_len(key1, i);
-    keys1[i] = castle_key_elem_data(key1, i);
-    flags1[i] = castle_key_elem_flags(key1, i);
-  }
-
-  for (int i = 0; i < dims2; i++) {
-    lens2[i] = castle_key_elem_len(key2, i);
-    keys2[i] = castle_key_elem_data(key2, i);
-    flags2[i] = castle_key_elem_flags(key2, i);
-  }
-
-  key1_len = castle_key_bytes_needed(dims1, lens1, NULL, NULL);
-  key2_len = castle_key_bytes_needed(dims2, lens2, NULL, NULL);
+  key1_len = contiguous1 ? castle_key_length(key1) : castle_key_buffer_len(key1);
+  key2_len = contiguous2 ? castle_key_length(key2) : castle_key_buffer_len(key2);
 
   err = castle_shared_buffer_create(conn, &key_buf, key1_len + key2_len);
   if (err)
     return err;
 
-  {
-    int r = castle_build_key((castle_key *)key_buf, key1_len, dims1, lens1,
-                             (const uint8_t *const *)keys1, flags1);
-    if (r != 0)
-      /* impossible */
-      abort();
-  }
-
-  {
-    int r = castle_build_key((castle_key *)(key_buf + key1_len), key2_len, dims2,
-                             lens2, (const uint8_t *const *)keys2, flags2);
-    if (r != 0)
-      /* impossible */
-      abort();
-  }
+  if (contiguous1)
+    castle_key_copy_contiguous(key1, key_buf, key1_len);
+  else
+    castle_key_buffer_fill(key1, key_buf, key1_len);
+  if (contiguous2)
+    castle_key_copy_contiguous(key2, key_buf + key1_len, key2_len);
+  else
+    castle_key_buffer_fill(key2, key_buf + key1_len, key2_len);
 
   *key_buf_out = key_buf;
   *key1_len_out = key1_len;
@@ -201,10 +242,26 @@ int castle_key_copy(c_vl_bkey_t *key, void *buf, uint32_t buf_len)
 
 #define max(_a, _b) ((_a) > (_b) ? (_a) : (_b))
 
-int castle_get(castle_connection *conn,
-               c_collection_id_t collection,
-               castle_key *key,
-               char **value_out, uint32_t *value_len_out)
+/*
+ * Called as a write to key is sent and again once it has completed: drops any
+ * cached copy, and stops new gets joining one already in flight.
+ */
+static void castle_key_written(c_collection_id_t collection, castle_key *key)
+{
+    castle_read_cache_invalidate(collection, key);
+    castle_single_flight_forget(collection, key);
+}
+
+/**
+ * Read key from the kernel, offering the value to the read cache if enabled.
+ *
+ * @param   cache_gen   Generation returned by the read cache lookup that missed
+ */
+int castle_get_fetch(castle_connection *conn,
+                     c_collection_id_t collection,
+                     castle_key *key,
+                     uint64_t cache_gen,
+                     char **value_out, uint32_t *value_len_out)
 {
     struct castle_blocking_call call;
     castle_request_t req;
@@ -213,6 +270,7 @@ int castle_get(castle_connection *conn,
     uint32_t key_len;
     uint32_t val_len = PAGE_SIZE;
     char *value;
+    int cached = castle_read_cache_enabled();
 
     err = make_key_buffer(conn, key, 0, &key_buf, &key_len);
     if (err) goto err0;
@@ -226,7 +284,7 @@ int castle_get(castle_connection *conn,
                        key_len,
                        val_buf,
                        val_len,
-                       CASTLE_RING_FLAG_NONE);
+                       cached ? CASTLE_RING_FLAG_RET_TIMESTAMP : CASTLE_RING_FLAG_NONE);
 
     err = castle_request_do_blocking(conn, &req, &call);
     if (err) goto err2;
@@ -285,6 +343,9 @@ int castle_get(castle_connection *conn,
 
         memcpy(value, val_buf, call.length);
 
+        if (cached)
+            castle_read_cache_fill(collection, key, value, call.length, call.user_timestamp, cache_gen);
+
         *value_len_out = call.length;
         *value_out = value;
     }
@@ -294,6 +355,32 @@ err1: castle_shared_buffer_destroy(conn, key_buf, key_len);
 err0: return err;
 }
 
+int castle_get(castle_connection *conn,
+               c_collection_id_t collection,
+               castle_key *key,
+               char **value_out, uint32_t *value_len_out)
+{
+    uint64_t cache_gen = 0;
+    int err;
+
+    if (conn->write_behind)
+    {
+        /* Read our own buffered writes. */
+        err = castle_write_behind_get(conn, collection, key, value_out, value_len_out);
+        if (err <= 0)
+            return err;
+    }
+
+    if (castle_read_cache_enabled()
+            && !castle_read_cache_lookup(collection, key, value_out, value_len_out, &cache_gen))
+        return 0;
+
+    if (castle_single_flight_enabled())
+        return castle_single_flight_get(conn, collection, key, cache_gen, value_out, value_len_out);
+
+    return castle_get_fetch(conn, collection, key, cache_gen, value_out, value_len_out);
+}
+
 int castle_replace(castle_connection *conn,
                    c_collection_id_t collection,
                    castle_key *key,
@@ -305,6 +392,10 @@ int castle_replace(castle_connection *conn,
     uint32_t key_len;
     int err = 0;
 
+    castle_key_written(collection, key);
+    if (conn->write_behind)
+        return castle_write_behind_put(conn, collection, key, val, val_len, CASTLE_WRITE_REPLACE);
+
     err = make_key_buffer(conn, key, val_len, &buf, &key_len);
     if (err) goto err0;
 
@@ -318,6 +409,7 @@ int castle_replace(castle_connection *conn,
                            CASTLE_RING_FLAG_NONE);
 
     err = castle_request_do_blocking(conn, &req, &call);
+    castle_key_written(collection, key);
     if (err) goto err1;
 
 err1: castle_shared_buffer_destroy(conn, buf, key_len + val_len);
@@ -336,11 +428,17 @@ int castle_timestamped_replace(castle_connection *conn,
     uint32_t key_len;
     int err = 0;
 
+    /* Not buffered, but must follow earlier buffered writes. */
+    err = castle_write_behind_flush(conn);
+    if (err) goto err0;
+
     err = make_key_buffer(conn, key, val_len, &buf, &key_len);
     if (err) goto err0;
 
     memcpy(buf + key_len, val, val_len);
 
+    castle_key_written(collection, key);
+
     castle_timestamped_replace_prepare(&req,
                                        collection,
                                        (castle_key *) buf,
@@ -350,6 +448,7 @@ int castle_timestamped_replace(castle_connection *conn,
                                        CASTLE_RING_FLAG_NONE);
 
     err = castle_request_do_blocking(conn, &req, &call);
+    castle_key_written(collection, key);
     if (err) goto err1;
 
 err1: castle_shared_buffer_destroy(conn, buf, key_len + val_len);
@@ -366,6 +465,10 @@ int castle_remove(castle_connection *conn,
     uint32_t key_len;
     int err = 0;
 
+    castle_key_written(collection, key);
+    if (conn->write_behind)
+        return castle_write_behind_put(conn, collection, key, NULL, 0, CASTLE_WRITE_REMOVE);
+
     err = make_key_buffer(conn, key, 0, &key_buf, &key_len);
     if (err) goto err0;
 
@@ -376,6 +479,7 @@ int castle_remove(castle_connection *conn,
                           CASTLE_RING_FLAG_NONE);
 
     err = castle_request_do_blocking(conn, &req, &call);
+    castle_key_written(collection, key);
     if (err) goto err1;
 
 err1: castle_shared_buffer_destroy(conn, key_buf, key_len);
@@ -393,9 +497,15 @@ int castle_timestamped_remove(castle_connection *conn,
     uint32_t key_len;
     int err = 0;
 
+    /* Not buffered, but must follow earlier buffered writes. */
+    err = castle_write_behind_flush(conn);
+    if (err) goto err0;
+
     err = make_key_buffer(conn, key, 0, &key_buf, &key_len);
     if (err) goto err0;
 
+    castle_key_written(collection, key);
+
     castle_timestamped_remove_prepare(&req,
                                       collection,
                                       (castle_key *) key_buf,
@@ -404,192 +514,687 @@ int castle_timestamped_remove(castle_connection *conn,
                                       CASTLE_RING_FLAG_NONE);
 
     err = castle_request_do_blocking(conn, &req, &call);
+    castle_key_written(collection, key);
     if (err) goto err1;
 
 err1: castle_shared_buffer_destroy(conn, key_buf, key_len);
 err0: return err;
 }
 
-#define VALUE_INLINE(_type)     ((_type == CASTLE_VALUE_TYPE_INLINE) ||             \
-                                 (_type == CASTLE_VALUE_TYPE_INLINE_COUNTER))
-
-/**
- * Free allocated list of KVs.
+/*
+ * Asynchronous variants of the calls above.
  *
- * Take care not to loop backwards in case of KVs list where the Castle iterator
- * has more keys to return.
+ * The key (and value) are copied into a shared buffer taken from the
+ * connection's buffer cache, the request is put on the ring and the call
+ * returns.  The buffer goes back to the cache when the response arrives, just
+ * before the callback is invoked.  Callbacks run on the connection's response
+ * thread, so they must not make blocking calls on the same connection.
+ *
+ * The calls never wait for space on the ring, so they can be made from a
+ * callback.  If the ring is full they return -EAGAIN without sending, and the
+ * callback is not called; retry once earlier requests have completed.
+ *
+ * With write-behind enabled on the connection, replaces and removes are
+ * buffered and gets of a buffered key are answered from the buffer; both
+ * complete, callback and all, before the call returns.  A timestamped write to
+ * a key with a buffered write first flushes, so that it lands after it; that
+ * blocks, so such writes must not be made from a callback.
  */
-void castle_kvs_free(struct castle_key_value_list *kvs)
+
+struct castle_async_op
 {
-    while (kvs)
-    {
-        struct castle_key_value_list *next = kvs->next;
+    union {
+        castle_get_callback   get;
+        castle_async_callback done;
+    } callback;
+    void     *userdata;
+    char     *buf;
+    uint32_t  buf_len;
+    uint32_t  val_offset;
+    c_collection_id_t collection;   /**< Of writes, for read cache invalidation */
+};
+
+/* Key buffers are padded to this alignment when a value follows them. */
+#define ASYNC_VAL_ALIGN 8
+#define async_val_offset(_key_len) (((_key_len) + ASYNC_VAL_ALIGN - 1) & ~(ASYNC_VAL_ALIGN - 1))
+
+static int castle_async_op_alloc(castle_connection *conn,
+                                 castle_key *key,
+                                 uint32_t val_len,
+                                 void *userdata,
+                                 struct castle_async_op **op_out,
+                                 uint32_t *key_len_out)
+{
+    struct castle_async_op *op;
+    uint32_t key_len = castle_key_buffer_len(key);
+    int err;
 
-        if (kvs->key)
-            free(kvs->key);
-        if (kvs->val)
-        {
-            if (kvs->val->val)
-                free(kvs->val->val);
-            free(kvs->val);
-        }
-        free(kvs);
+    op = malloc(sizeof(*op));
+    if (!op)
+        return -ENOMEM;
 
-        kvs = next;
+    op->userdata = userdata;
+    op->val_offset = async_val_offset(key_len);
+    op->buf_len = op->val_offset + val_len;
+
+    err = castle_shared_buffer_get(conn, op->buf_len, &op->buf);
+    if (err)
+    {
+        free(op);
+        return err;
     }
+
+    castle_key_buffer_fill(key, op->buf, key_len);
+
+    *op_out = op;
+    *key_len_out = key_len;
+    return 0;
 }
 
-/**
- * Process buf and return list of kvs.
- *
- * @param   [out]   kvs     List of keys,values returned by iterator.
- * @param   [out]   more    1 => Iterator has more keys to provide
- *                          0 => Iterator has completed
- *
- * @return  0       Success
- * @return -ENOMEM  Allocation failure
- * @return  *       Other failure
- */
-static int castle_iter_process_kvs(castle_connection *conn,
-                                   char *buf,
-                                   struct castle_key_value_list **kvs,
-                                   int *more)
+static void castle_async_op_free(castle_connection *conn, struct castle_async_op *op)
 {
-    struct castle_key_value_list *curr, *prev, *head = NULL, *tail = NULL, *copy;
-    int key_len, err = 0;
+    castle_shared_buffer_put(conn, op->buf, op->buf_len);
+    free(op);
+}
 
-    if (more)
-        *more = 0;
+static void castle_async_done_callback(castle_connection *conn, castle_response_t *resp, void *data)
+{
+    struct castle_async_op *op = data;
+    castle_async_callback callback = op->callback.done;
+    void *userdata = op->userdata;
 
-    curr = (struct castle_key_value_list *)buf;
-    assert(curr);
+    castle_key_written(op->collection, (castle_key *)op->buf);
+    castle_async_op_free(conn, op);
 
-    if (curr->key == NULL)
-        /* No keys returned by iterator. */
-        goto out;
+    if (callback)
+        callback(conn, resp->err, userdata);
+}
 
-    prev = curr;
-    while (curr)
-    {
-        if (curr < prev)
-        {
-            /* We've reached the end of this set of results but the iterator
-             * has more results to return.  Call ITER_NEXT. */
-            if (more)
-                *more = 1;
+static void castle_async_get_callback(castle_connection *conn, castle_response_t *resp, void *data)
+{
+    struct castle_async_op *op = data;
+    uint64_t val_space = op->buf_len - op->val_offset;
+    int err = resp->err;
 
-            goto out;
-        }
+    if (!err && resp->length > val_space)
+        err = -ENOBUFS;
 
-        /* Otherwise we have a valid key to return. */
+    op->callback.get(conn, err, err ? NULL : op->buf + op->val_offset, resp->length, op->userdata);
 
-        /* Allocate local kvlist-entry. */
-        key_len = castle_key_length(curr->key);
-        copy = calloc(1, sizeof(*copy));
-        if (!copy)
-        {
-            err = -ENOMEM;
-            goto err1;
-        }
-        copy->key = malloc(key_len);
-        if (!copy->key)
-        {
-            err = -ENOMEM;
-            goto err2;
-        }
+    castle_async_op_free(conn, op);
+}
 
-        /* Fill key. */
-        err = castle_key_copy(curr->key, copy->key, key_len);
-        if (err)
-            goto err3;
+/*
+ * Put an async request on the ring without waiting for space: the response
+ * thread is the only one that frees ring slots, so a send from a callback
+ * which waited for space could never complete.
+ */
+static int castle_async_send(castle_connection *conn, castle_request_t *req,
+                             castle_callback callback, struct castle_async_op *op)
+{
+    int err;
 
-        /* Fill val, do castle_get() if necessary. */
-        copy->val = malloc(sizeof(*(copy->val)));
-        if (!copy->val)
-        {
-            err = -ENOMEM;
-            goto err3;
-        }
-        memcpy(copy->val, curr->val, sizeof(*(copy->val)));
-        if (VALUE_INLINE(curr->val->type))
-        {
-            copy->val->val = malloc(copy->val->length);
-            if (!copy->val->val)
-            {
-                err = -ENOMEM;
-                goto err4;
-            }
-            memcpy(copy->val->val, curr->val->val, copy->val->length);
-        }
-        else
-        {
-            char *val;
-            uint32_t val_len;
-            err = castle_get(conn, curr->val->collection_id, curr->key, &val, &val_len);
-            if (err)
-                goto err4;
-            copy->val->length = val_len;
-            copy->val->val = (uint8_t *)val;
-            copy->val->type = CASTLE_VALUE_TYPE_INLINE; /* fake it for consumer */
-        }
+    err = castle_request_send_nowait(conn, req, callback, op);
+    if (err)
+        castle_async_op_free(conn, op);
 
-        if (!head)
-            /* Start the list. */
-            head = copy;
-        else
-            /* Add the newest item to the tail of the list. */
-            tail->next = copy;
+    return err;
+}
 
-        tail = copy;
-        prev = curr;
-        curr = curr->next;
-    }
+/* Complete an async write through write-behind, which has taken the write. */
+static int castle_async_write_behind(castle_connection *conn,
+                                     c_collection_id_t collection,
+                                     castle_key *key,
+                                     const char *val, uint32_t val_len,
+                                     uint8_t type,
+                                     castle_async_callback callback,
+                                     void *userdata)
+{
+    int err;
 
-out:
-    *kvs = head;
-    if (tail)
-        tail->next = NULL;
+    castle_key_written(collection, key);
+    err = castle_write_behind_put(conn, collection, key, val, val_len, type);
+    if (err)
+        return err;
+
+    if (callback)
+        callback(conn, 0, userdata);
 
     return 0;
+}
 
-err4: free(copy->val);
-err3: free(copy->key);
-err2: free(copy);
-err1: castle_kvs_free(head);
+/* Order a timestamped async write after any buffered write to its key. */
+static int castle_async_write_behind_order(castle_connection *conn,
+                                           c_collection_id_t collection,
+                                           castle_key *key)
+{
+    if (!conn->write_behind || !castle_write_behind_pending(conn, collection, key))
+        return 0;
 
-    return err;
+    return castle_write_behind_flush(conn);
 }
 
 /**
- * Start an iterator and return a list of keys.
+ * Start a get without waiting for it.
  *
- * @param   [out]   kvs     List of keys,values returned by iterator.
- * @param   [out]   more    1 => Iterator has more keys to provide
- *                          0 => Iterator has completed
+ * The callback is passed a pointer to the value inside a shared buffer, which
+ * is only valid until the callback returns.  Values longer than max_value_len
+ * complete with -ENOBUFS and their full length; fetch those with castle_get()
+ * or castle_big_get().
+ *
+ * @param   max_value_len   Largest value expected, 0 => PAGE_SIZE
+ *
+ * @return  0 if the request was sent, in which case callback will be called
+ * @return -EAGAIN  The ring is full, see above
  */
-int castle_iter_start(castle_connection *conn,
-                      c_collection_id_t collection,
-                      castle_key *start_key,
-                      castle_key *end_key,
-                      castle_interface_token_t *token_out,
-                      struct castle_key_value_list **kvs,
-                      uint32_t buf_size,
-                      int *more)
+int castle_get_async(castle_connection *conn,
+                     c_collection_id_t collection,
+                     castle_key *key,
+                     uint32_t max_value_len,
+                     castle_get_callback callback,
+                     void *userdata)
 {
-    struct castle_blocking_call call;
+    struct castle_async_op *op;
     castle_request_t req;
-    char *key_buf, *ret_buf;
-    uint32_t start_key_len;
-    uint32_t end_key_len;
+    uint32_t key_len;
+    int err;
+
+    if (!callback)
+        return -EINVAL;
+
+    if (max_value_len == 0)
+        max_value_len = PAGE_SIZE;
+
+    if (conn->write_behind)
+    {
+        /* Read our own buffered writes. */
+        char *value;
+        uint32_t value_len;
+
+        err = castle_write_behind_get(conn, collection, key, &value, &value_len);
+        if (err == -ENOENT)
+            callback(conn, err, NULL, 0, userdata);
+        else if (err == 0)
+        {
+            if (value_len > max_value_len)
+                callback(conn, -ENOBUFS, NULL, value_len, userdata);
+            else
+                callback(conn, 0, value, value_len, userdata);
+            free(value);
+        }
+        if (err <= 0)
+            return err == -ENOENT ? 0 : err;
+    }
+
+    err = castle_async_op_alloc(conn, key, max_value_len, userdata, &op, &key_len);
+    if (err)
+        return err;
+    op->callback.get = callback;
+
+    castle_get_prepare(&req,
+                       collection,
+                       (castle_key *) op->buf,
+                       key_len,
+                       op->buf + op->val_offset,
+                       max_value_len,
+                       CASTLE_RING_FLAG_NONE);
+
+    return castle_async_send(conn, &req, castle_async_get_callback, op);
+}
+
+int castle_replace_async(castle_connection *conn,
+                         c_collection_id_t collection,
+                         castle_key *key,
+                         char *val, uint32_t val_len,
+                         castle_async_callback callback,
+                         void *userdata)
+{
+    struct castle_async_op *op;
+    castle_request_t req;
+    uint32_t key_len;
+    int err;
+
+    if (conn->write_behind)
+        return castle_async_write_behind(conn, collection, key, val, val_len,
+                                         CASTLE_WRITE_REPLACE, callback, userdata);
+
+    err = castle_async_op_alloc(conn, key, val_len, userdata, &op, &key_len);
+    if (err)
+        return err;
+    op->callback.done = callback;
+
+    memcpy(op->buf + op->val_offset, val, val_len);
+
+    castle_replace_prepare(&req,
+                           collection,
+                           (castle_key *) op->buf,
+                           key_len,
+                           op->buf + op->val_offset,
+                           val_len,
+                           CASTLE_RING_FLAG_NONE);
+
+    op->collection = collection;
+    castle_key_written(collection, key);
+
+    return castle_async_send(conn, &req, castle_async_done_callback, op);
+}
+
+int castle_timestamped_replace_async(castle_connection *conn,
+                                     c_collection_id_t collection,
+                                     castle_key *key,
+                                     char *val, uint32_t val_len,
+                                     castle_user_timestamp_t u_ts,
+                                     castle_async_callback callback,
+                                     void *userdata)
+{
+    struct castle_async_op *op;
+    castle_request_t req;
+    uint32_t key_len;
+    int err;
+
+    err = castle_async_write_behind_order(conn, collection, key);
+    if (err)
+        return err;
+
+    err = castle_async_op_alloc(conn, key, val_len, userdata, &op, &key_len);
+    if (err)
+        return err;
+    op->callback.done = callback;
+
+    memcpy(op->buf + op->val_offset, val, val_len);
+
+    castle_timestamped_replace_prepare(&req,
+                                       collection,
+                                       (castle_key *) op->buf,
+                                       key_len,
+                                       op->buf + op->val_offset,
+                                       val_len,
+                                       u_ts,
+                                       CASTLE_RING_FLAG_NONE);
+
+    op->collection = collection;
+    castle_key_written(collection, key);
+
+    return castle_async_send(conn, &req, castle_async_done_callback, op);
+}
+
+int castle_remove_async(castle_connection *conn,
+                        c_collection_id_t collection,
+                        castle_key *key,
+                        castle_async_callback callback,
+                        void *userdata)
+{
+    struct castle_async_op *op;
+    castle_request_t req;
+    uint32_t key_len;
+    int err;
+
+    if (conn->write_behind)
+        return castle_async_write_behind(conn, collection, key, NULL, 0,
+                                         CASTLE_WRITE_REMOVE, callback, userdata);
+
+    err = castle_async_op_alloc(conn, key, 0, userdata, &op, &key_len);
+    if (err)
+        return err;
+    op->callback.done = callback;
+
+    castle_remove_prepare(&req,
+                          collection,
+                          (castle_key *) op->buf,
+                          key_len,
+                          CASTLE_RING_FLAG_NONE);
+
+    op->collection = collection;
+    castle_key_written(collection, key);
+
+    return castle_async_send(conn, &req, castle_async_done_callback, op);
+}
+
+int castle_timestamped_remove_async(castle_connection *conn,
+                                    c_collection_id_t collection,
+                                    castle_key *key,
+                                    castle_user_timestamp_t u_ts,
+                                    castle_async_callback callback,
+                                    void *userdata)
+{
+    struct castle_async_op *op;
+    castle_request_t req;
+    uint32_t key_len;
+    int err;
+
+    err = castle_async_write_behind_order(conn, collection, key);
+    if (err)
+        return err;
+
+    err = castle_async_op_alloc(conn, key, 0, userdata, &op, &key_len);
+    if (err)
+        return err;
+    op->callback.done = callback;
+
+    castle_timestamped_remove_prepare(&req,
+                                      collection,
+                                      (castle_key *) op->buf,
+                                      key_len,
+                                      u_ts,
+                                      CASTLE_RING_FLAG_NONE);
+
+    op->collection = collection;
+    castle_key_written(collection, key);
+
+    return castle_async_send(conn, &req, castle_async_done_callback, op);
+}
+
+/**
+ * Free allocated list of KVs.
+ *
+ * Take care not to loop backwards in case of KVs list where the Castle iterator
+ * has more keys to return.
+ */
+void castle_kvs_free(struct castle_key_value_list *kvs)
+{
+    while (kvs)
+    {
+        struct castle_key_value_list *next = kvs->next;
+
+        if (kvs->key)
+            free(kvs->key);
+        if (kvs->val)
+        {
+            if (kvs->val->val)
+                free(kvs->val->val);
+            free(kvs->val);
+        }
+        free(kvs);
+
+        kvs = next;
+    }
+}
+
+/*
+ * Out-of-line values met while processing an iterator buffer.  They are
+ * collected for the whole batch and then read with castle_get_multi(), so a
+ * batch costs one round of pipelined gets rather than a blocking castle_get
+ * per value.
+ */
+struct castle_iter_ool
+{
+    struct castle_key_value_list *kv;       /**< Copied entry awaiting its value            */
+    castle_key                   *key;      /**< Key in the iterator buffer                 */
+    c_collection_id_t             collection;
+};
+
+static int castle_iter_resolve_ool(castle_connection *conn,
+                                   struct castle_iter_ool *ool,
+                                   unsigned int count)
+{
+    unsigned int start = 0, end, i;
+    int err = 0;
+
+    while (start < count && !err)
+    {
+        struct castle_get_result *results;
+        castle_key **keys;
+        char *arena;
+
+        /* Take a run of entries from the same collection. */
+        for (end = start + 1; end < count && ool[end].collection == ool[start].collection; end++);
+
+        results = calloc(end - start, sizeof(*results));
+        keys = calloc(end - start, sizeof(*keys));
+        if (!results || !keys)
+        {
+            err = -ENOMEM;
+            goto out;
+        }
+        for (i = start; i < end; i++)
+            keys[i - start] = ool[i].key;
+
+        err = castle_get_multi(conn, ool[start].collection, keys, end - start, results, &arena);
+        if (err)
+            goto out;
+
+        for (i = start; i < end && !err; i++)
+        {
+            struct castle_get_result *result = &results[i - start];
+            struct castle_iter_val *val = ool[i].kv->val;
+
+            err = result->err;
+            if (err)
+                break;
+
+            val->val = malloc(result->value_len ? result->value_len : 1);
+            if (!val->val)
+            {
+                err = -ENOMEM;
+                break;
+            }
+            memcpy(val->val, result->value, result->value_len);
+            val->length = result->value_len;
+            val->type = CASTLE_VALUE_TYPE_INLINE; /* fake it for consumer */
+        }
+
+        free(arena);
+out:
+        free(keys);
+        free(results);
+        start = end;
+    }
+
+    return err;
+}
+
+/**
+ * Process buf and return list of kvs.
+ *
+ * @param   [in]    filter  Entries filter->fn rejects are skipped in buf
+ *                          rather than copied out; NULL => keep every entry
+ * @param   [out]   kvs     List of keys,values returned by iterator.
+ * @param   [out]   more    1 => Iterator has more keys to provide
+ *                          0 => Iterator has completed
+ *
+ * @return  0       Success
+ * @return -ENOMEM  Allocation failure
+ * @return  *       Other failure
+ */
+static int castle_iter_process_kvs(castle_connection *conn,
+                                   char *buf,
+                                   struct castle_iter_filter *filter,
+                                   struct castle_key_value_list **kvs,
+                                   int *more)
+{
+    struct castle_key_value_list *curr, *prev, *head = NULL, *tail = NULL, *copy;
+    struct castle_iter_ool *ool = NULL;
+    unsigned int nr_ool = 0, max_ool = 0;
+    uint64_t scanned = 0, entries = 0, bytes = 0;
+    int key_len, err = 0;
+
+    if (more)
+        *more = 0;
+
+    curr = (struct castle_key_value_list *)buf;
+    assert(curr);
+
+    if (curr->key == NULL)
+        /* No keys returned by iterator. */
+        goto out;
+
+    prev = curr;
+    while (curr)
+    {
+        if (curr < prev)
+        {
+            /* We've reached the end of this set of results but the iterator
+             * has more results to return.  Call ITER_NEXT. */
+            if (more)
+                *more = 1;
+
+            goto out;
+        }
+
+        /* Otherwise we have a valid key to return, unless it is filtered out. */
+        if (filter)
+        {
+            scanned++;
+            if (!filter->fn(curr->key, curr->val, curr->user_timestamp, filter->userdata))
+            {
+                prev = curr;
+                curr = curr->next;
+                continue;
+            }
+        }
+
+        /* Allocate local kvlist-entry. */
+        key_len = castle_key_length(curr->key);
+        copy = calloc(1, sizeof(*copy));
+        if (!copy)
+        {
+            err = -ENOMEM;
+            goto err1;
+        }
+        copy->key = malloc(key_len);
+        if (!copy->key)
+        {
+            err = -ENOMEM;
+            goto err2;
+        }
+
+        /* Fill key. */
+        err = castle_key_copy(curr->key, copy->key, key_len);
+        if (err)
+            goto err3;
+
+        /* Fill val, deferring out-of-line values to castle_iter_resolve_ool(). */
+        copy->val = malloc(sizeof(*(copy->val)));
+        if (!copy->val)
+        {
+            err = -ENOMEM;
+            goto err3;
+        }
+        memcpy(copy->val, curr->val, sizeof(*(copy->val)));
+        if (VALUE_INLINE(curr->val->type))
+        {
+            copy->val->val = malloc(copy->val->length);
+            if (!copy->val->val)
+            {
+                err = -ENOMEM;
+                goto err4;
+            }
+            memcpy(copy->val->val, curr->val->val, copy->val->length);
+        }
+        else
+        {
+            if (nr_ool == max_ool)
+            {
+                unsigned int new_max = max_ool ? max_ool * 2 : 16;
+                struct castle_iter_ool *new_ool = realloc(ool, new_max * sizeof(*ool));
+                if (!new_ool)
+                {
+                    err = -ENOMEM;
+                    goto err4;
+                }
+                ool = new_ool;
+                max_ool = new_max;
+            }
+            ool[nr_ool].kv = copy;
+            ool[nr_ool].key = curr->key;
+            ool[nr_ool].collection = curr->val->collection_id;
+            nr_ool++;
+            copy->val->val = NULL;
+        }
+
+        entries++;
+        bytes += key_len + (VALUE_INLINE(curr->val->type) ? curr->val->length : 0);
+
+        if (!head)
+            /* Start the list. */
+            head = copy;
+        else
+            /* Add the newest item to the tail of the list. */
+            tail->next = copy;
+
+        tail = copy;
+        prev = curr;
+        curr = curr->next;
+    }
+
+out:
+    if (tail)
+        tail->next = NULL;
+
+    __sync_fetch_and_add(&conn->iter_round_trips, 1);
+    __sync_fetch_and_add(&conn->iter_entries, entries);
+    __sync_fetch_and_add(&conn->iter_bytes, bytes);
+
+    if (nr_ool)
+    {
+        err = castle_iter_resolve_ool(conn, ool, nr_ool);
+        free(ool);
+        if (err)
+        {
+            castle_kvs_free(head);
+            return err;
+        }
+    }
+
+    /* Only count entries the caller actually gets. */
+    if (filter)
+    {
+        filter->scanned += scanned;
+        filter->emitted += entries;
+    }
+
+    *kvs = head;
+
+    return 0;
+
+err4: free(copy->val);
+err3: free(copy->key);
+err2: free(copy);
+err1: castle_kvs_free(head);
+    free(ool);
+
+    return err;
+}
+
+/**
+ * Start an iterator and return a list of keys.
+ *
+ * @param   [out]   kvs     List of keys,values returned by iterator.
+ * @param   [out]   more    1 => Iterator has more keys to provide
+ *                          0 => Iterator has completed
+ * @param   [in]    flags   CASTLE_RING_FLAGs for the iterator, e.g.
+ *                          CASTLE_RING_FLAG_ITER_GET_OOL to have the server
+ *                          return out-of-line values inline
+ * @param   [in]    filter  Predicate run on each entry in the shared buffer;
+ *                          only entries it accepts are copied into kvs, so a
+ *                          batch can come back empty with *more set.  NULL
+ *                          => return every entry
+ */
+int castle_iter_start_filter(castle_connection *conn,
+                             c_collection_id_t collection,
+                             castle_key *start_key,
+                             castle_key *end_key,
+                             castle_interface_token_t *token_out,
+                             struct castle_key_value_list **kvs,
+                             uint32_t buf_size,
+                             int *more,
+                             uint8_t flags,
+                             struct castle_iter_filter *filter)
+{
+    struct castle_blocking_call call;
+    castle_request_t req;
+    char *key_buf, *ret_buf;
+    uint32_t start_key_len;
+    uint32_t end_key_len;
     int err = 0;
 
     *token_out = 0;
 
-    err = make_2key_buffer(conn, start_key, end_key, &key_buf, &start_key_len, &end_key_len);
+    err = castle_make_2key_buffer(conn, start_key, end_key, &key_buf, &start_key_len, &end_key_len);
     if (err)
         goto err0;
 
-    err = castle_shared_buffer_create(conn, &ret_buf, buf_size);
+    err = castle_shared_buffer_get(conn, buf_size, &ret_buf);
     if (err)
         goto err1;
 
@@ -601,13 +1206,13 @@ int castle_iter_start(castle_connection *conn,
                               end_key_len,              /* end_key_len      */
                               ret_buf,                  /* buffer           */
                               buf_size,                 /* buffer_len       */
-                              CASTLE_RING_FLAG_NONE);   /* flags            */
+                              flags);                   /* flags            */
 
     err = castle_request_do_blocking(conn, &req, &call);
     if (err)
         goto err2;
 
-    err = castle_iter_process_kvs(conn, ret_buf, kvs, more);
+    err = castle_iter_process_kvs(conn, ret_buf, filter, kvs, more);
     if (err)
         goto err2;
 
@@ -616,25 +1221,57 @@ int castle_iter_start(castle_connection *conn,
     /* overflow into errs */
 
 err2:
-    castle_shared_buffer_destroy(conn, ret_buf, buf_size);
+    castle_shared_buffer_put(conn, ret_buf, buf_size);
 err1:
     castle_shared_buffer_destroy(conn, key_buf, start_key_len + end_key_len);
 err0:
     return err;
 }
 
+int castle_iter_start_flags(castle_connection *conn,
+                            c_collection_id_t collection,
+                            castle_key *start_key,
+                            castle_key *end_key,
+                            castle_interface_token_t *token_out,
+                            struct castle_key_value_list **kvs,
+                            uint32_t buf_size,
+                            int *more,
+                            uint8_t flags)
+{
+    return castle_iter_start_filter(conn, collection, start_key, end_key, token_out,
+                                    kvs, buf_size, more, flags, NULL);
+}
+
+int castle_iter_start(castle_connection *conn,
+                      c_collection_id_t collection,
+                      castle_key *start_key,
+                      castle_key *end_key,
+                      castle_interface_token_t *token_out,
+                      struct castle_key_value_list **kvs,
+                      uint32_t buf_size,
+                      int *more)
+{
+    return castle_iter_start_flags(conn, collection, start_key, end_key, token_out,
+                                   kvs, buf_size, more, CASTLE_RING_FLAG_NONE);
+}
+
 /**
  * Continue an iterator and return a list of keys.
  *
  * @param   [out]   kvs     List of keys,values returned by iterator.
  * @param   [out]   more    1 => Iterator has more keys to provide
  *                          0 => Iterator has completed
+ * @param   [in]    flags   CASTLE_RING_FLAGs, normally those the iterator
+ *                          was started with
+ * @param   [in]    filter  As for castle_iter_start_filter()
  */
-int castle_iter_next(castle_connection *conn,
-                     castle_interface_token_t token,
-                     struct castle_key_value_list **kvs,
-                     uint32_t buf_size,
-                     int *more)
+int castle_iter_next_filter(castle_connection *conn,
+                            castle_interface_token_t token,
+                            struct castle_key_value_list **kvs,
+                            uint32_t buf_size,
+                            int *more,
+                            uint8_t flags,
+                            struct castle_iter_filter *filter)
 {
     struct castle_blocking_call call;
     castle_request_t req;
@@ -643,30 +1280,49 @@ int castle_iter_next(castle_connection *conn,
 
     *kvs = NULL;
 
-    err = castle_shared_buffer_create(conn, &buf, buf_size);
+    err = castle_shared_buffer_get(conn, buf_size, &buf);
     if (err)
         goto err0;
 
-    castle_iter_next_prepare(&req, token, buf, buf_size, CASTLE_RING_FLAG_NONE);
+    castle_iter_next_prepare(&req, token, buf, buf_size, flags);
 
     err = castle_request_do_blocking(conn, &req, &call);
     if (err)
         goto err1;
 
-    err = castle_iter_process_kvs(conn, buf, kvs, more);
+    err = castle_iter_process_kvs(conn, buf, filter, kvs, more);
     if (err)
         goto err1;
 
-    castle_shared_buffer_destroy(conn, buf, buf_size);
+    castle_shared_buffer_put(conn, buf, buf_size);
 
     return 0;
 
 err1:
-    castle_shared_buffer_destroy(conn, buf, buf_size);
+    castle_shared_buffer_put(conn, buf, buf_size);
 err0:
     return err;
 }
 
+int castle_iter_next_flags(castle_connection *conn,
+                           castle_interface_token_t token,
+                           struct castle_key_value_list **kvs,
+                           uint32_t buf_size,
+                           int *more,
+                           uint8_t flags)
+{
+    return castle_iter_next_filter(conn, token, kvs, buf_size, more, flags, NULL);
+}
+
+int castle_iter_next(castle_connection *conn,
+                     castle_interface_token_t token,
+                     struct castle_key_value_list **kvs,
+                     uint32_t buf_size,
+                     int *more)
+{
+    return castle_iter_next_flags(conn, token, kvs, buf_size, more, CASTLE_RING_FLAG_NONE);
+}
+
 int castle_iter_finish(castle_connection *conn, castle_token token)
 {
     struct castle_blocking_call call;
@@ -693,10 +1349,11 @@ int castle_getslice(castle_connection *conn,
 {
     castle_token token;
     int err, more;
-    uint32_t count = 0;
+    uint32_t count = 0, batch;
+    uint32_t buf_size = PAGE_SIZE, grow_size = PAGE_SIZE;
     struct castle_key_value_list *head = NULL, *curr = NULL, *tail;
 
-    err = castle_iter_start(conn, collection, start_key, end_key, &token, &curr, PAGE_SIZE, &more);
+    err = castle_iter_start(conn, collection, start_key, end_key, &token, &curr, buf_size, &more);
     if (err)
     {
         head = curr; /* for free */
@@ -706,8 +1363,10 @@ int castle_getslice(castle_connection *conn,
     head = tail = curr; /* start at curr */
 
 process_loop:
+    batch = 0;
     while (curr)
     {
+        batch++;
         if (++count == limit)
         {
             /* Key limit reached.  Terminate iterator. */
@@ -727,8 +1386,26 @@ process_loop:
 
     if (more && (!limit || count < limit))
     {
+        /* Size the remaining keys from the density of the last batch, before
+         * buf_size moves on. */
+        uint64_t want = limit && batch ? (uint64_t)(limit - count) * buf_size / batch + PAGE_SIZE : 0;
+
+        /* The last batch filled its buffer, so double the buffer for the
+         * next one, up to the largest the ring accepts. */
+        if (grow_size < castle_max_buffer_size())
+            grow_size <<= 1;
+        buf_size = grow_size;
+
+        if (limit && want)
+        {
+            /* Shrink towards the estimate so a limit doesn't over-fetch. */
+
+            while (buf_size > PAGE_SIZE && (buf_size >> 1) >= want)
+                buf_size >>= 1;
+        }
+
         /* The iterator has more keys. */
-        err = castle_iter_next(conn, token, &curr, PAGE_SIZE, &more);
+        err = castle_iter_next(conn, token, &curr, buf_size, &more);
         if (err)
             goto err;
 
@@ -763,49 +1440,229 @@ int castle_big_put(castle_connection *conn,
     uint32_t key_len;
     int err = 0;
 
-    *token_out = 0;
+    *token_out = 0;
+
+    /* Not buffered, but must follow earlier buffered writes. */
+    err = castle_write_behind_flush(conn);
+    if (err) goto err0;
+
+    castle_key_written(collection, key);
+
+    err = make_key_buffer(conn, key, 0, &key_buf, &key_len);
+    if (err) goto err0;
+
+    castle_big_put_prepare(&req,
+                           collection,
+                           (castle_key *) key_buf,
+                           key_len,
+                           val_length,
+                           CASTLE_RING_FLAG_NONE);
+
+    err = castle_request_do_blocking(conn, &req, &call);
+    if (err) goto err1;
+
+    *token_out = call.token;
+
+err1: castle_shared_buffer_destroy(conn, key_buf, key_len);
+err0: return err;
+}
+
+int castle_put_chunk(castle_connection *conn,
+                     castle_interface_token_t token,
+                     char *value,
+                     uint32_t value_len)
+{
+    struct castle_blocking_call call;
+    castle_request_t req;
+    char *buf;
+    int err = 0;
+
+    err = castle_shared_buffer_create(conn, &buf, value_len);
+    if (err) goto err0;
+
+    memcpy(buf, value, value_len);
+
+    castle_put_chunk_prepare(&req, token, buf, value_len, CASTLE_RING_FLAG_NONE);
+
+    err = castle_request_do_blocking(conn, &req, &call);
+    if (err) goto err1;
+
+    err1: castle_shared_buffer_destroy(conn, buf, value_len);
+    err0: return err;
+}
+
+/* Number of put_chunk requests castle_big_put_stream() keeps in flight. */
+#define BIG_PUT_STREAM_DEPTH 3
+
+/**
+ * Fill buf with exactly len bytes from the reader.
+ *
+ * @return -ENODATA if the source ends early, or the reader's error
+ */
+static int stream_read_full(castle_read_fn reader, void *reader_data, char *buf, uint32_t len)
+{
+    uint32_t done = 0;
+
+    while (done < len)
+    {
+        ssize_t r = reader(reader_data, buf + done, len - done);
+        if (r == -EINTR)
+            continue;
+        if (r < 0)
+            return r;
+        if (r == 0)
+            return -ENODATA;
+        done += r;
+    }
+
+    return 0;
+}
+
+/* Request errors come back as errnos of either sign (castle_request_wait()
+ * gives EUNATCH); the streaming calls return them negative. */
+static inline int stream_err(int err)
+{
+    return err > 0 ? -err : err;
+}
+
+/* Remove the key written by a failed stream, bypassing write-behind so that
+ * the caller learns whether it went. */
+static int stream_remove(castle_connection *conn, c_collection_id_t collection, castle_key *key)
+{
+    struct castle_blocking_call call;
+    castle_request_t req;
+    char *key_buf;
+    uint32_t key_len;
+    int err;
+
+    err = make_key_buffer(conn, key, 0, &key_buf, &key_len);
+    if (err)
+        return err;
+
+    castle_remove_prepare(&req, collection, (castle_key *) key_buf, key_len,
+                          CASTLE_RING_FLAG_NONE);
+    err = castle_request_do_blocking(conn, &req, &call);
+    castle_key_written(collection, key);
+
+    castle_shared_buffer_destroy(conn, key_buf, key_len);
+
+    return err;
+}
+
+/**
+ * Write a large value, reading it from a caller-supplied source.
+ *
+ * The source is read straight into a ring of BIG_PUT_STREAM_DEPTH shared
+ * buffers, so while one chunk is being filled the previous ones are still
+ * being written by the kernel.  All put_chunk requests carry the big_put
+ * token, so castle_request_send() accounts for them against the token's
+ * CASTLE_STATEFUL_OPS slot.
+ *
+ * A big_put can't be cancelled, only completed.  If the reader fails partway,
+ * the rest of the value is sent as zeros so that the kernel releases the
+ * token, and the key is then removed rather than left holding a torn value.
+ * Once the big_put is open, a failed stream has destroyed the key's previous
+ * value, whatever is returned.
+ *
+ * @param   reader      Returns bytes read, 0 at end of input or a negative errno
+ * @param   val_length  Exact number of bytes the reader will supply
+ *
+ * @return -ENODATA if the source ends early, the reader's error, or the
+ *                  negated error of the request that failed, including the
+ *                  remove after a reader error
+ */
+int castle_big_put_stream(castle_connection *conn,
+                          c_collection_id_t collection,
+                          castle_key *key,
+                          castle_read_fn reader,
+                          void *reader_data,
+                          uint64_t val_length)
+{
+    struct castle_blocking_call calls[BIG_PUT_STREAM_DEPTH];
+    int busy[BIG_PUT_STREAM_DEPTH] = { 0 };
+    char *bufs[BIG_PUT_STREAM_DEPTH];
+    castle_request_t req;
+    castle_interface_token_t token;
+    uint32_t chunk_len = castle_max_buffer_size();
+    uint64_t remaining = val_length;
+    int depth = 0, slot = 0, err = 0, read_err = 0, ret;
+
+    /* Take the buffers before the token, so failing here leaves nothing open. */
+    while (depth < BIG_PUT_STREAM_DEPTH && (uint64_t)depth * chunk_len < val_length)
+    {
+        err = castle_shared_buffer_create(conn, &bufs[depth], chunk_len);
+        if (err) goto err1;
+        depth++;
+    }
+
+    err = castle_big_put(conn, collection, key, val_length, &token);
+    if (err) goto err1;
+
+    while (remaining > 0)
+    {
+        uint32_t len = remaining < chunk_len ? remaining : chunk_len;
+
+        if (busy[slot])
+        {
+            busy[slot] = 0;
+            err = castle_request_wait(conn, &calls[slot]);
+            if (err) goto err2;     /* the kernel has dropped the big_put */
+        }
+
+        if (!read_err)
+            read_err = stream_read_full(reader, reader_data, bufs[slot], len);
+        if (read_err)
+            memset(bufs[slot], 0, len);
 
-    err = make_key_buffer(conn, key, 0, &key_buf, &key_len);
-    if (err) goto err0;
+        castle_put_chunk_prepare(&req, token, bufs[slot], len, CASTLE_RING_FLAG_NONE);
+        castle_request_submit(conn, &req, &calls[slot], 1);
+        busy[slot] = 1;
 
-    castle_big_put_prepare(&req,
-                           collection,
-                           (castle_key *) key_buf,
-                           key_len,
-                           val_length,
-                           CASTLE_RING_FLAG_NONE);
+        remaining -= len;
+        slot = (slot + 1) % depth;
+    }
 
-    err = castle_request_do_blocking(conn, &req, &call);
-    if (err) goto err1;
+    /* overflow into errs, which drain the remaining chunks */
 
-    *token_out = call.token;
+err2:
+    for (int i = 0; i < depth; i++)
+    {
+        if (busy[i])
+        {
+            ret = castle_request_wait(conn, &calls[i]);
+            if (!err)
+                err = ret;
+        }
+    }
+    castle_key_written(collection, key);
+    if (read_err)
+    {
+        if (!err)
+            err = stream_remove(conn, collection, key);
+        if (!err)
+            err = read_err;
+    }
+err1:
+    for (int i = 0; i < depth; i++)
+        castle_shared_buffer_destroy(conn, bufs[i], chunk_len);
 
-err1: castle_shared_buffer_destroy(conn, key_buf, key_len);
-err0: return err;
+    return stream_err(err);
 }
 
-int castle_put_chunk(castle_connection *conn,
-                     castle_interface_token_t token,
-                     char *value,
-                     uint32_t value_len)
+static ssize_t fd_reader(void *data, char *buf, size_t len)
 {
-    struct castle_blocking_call call;
-    castle_request_t req;
-    char *buf;
-    int err = 0;
-
-    err = castle_shared_buffer_create(conn, &buf, value_len);
-    if (err) goto err0;
-
-    memcpy(buf, value, value_len);
-
-    castle_put_chunk_prepare(&req, token, buf, value_len, CASTLE_RING_FLAG_NONE);
+    ssize_t r = read(*(int *)data, buf, len);
 
-    err = castle_request_do_blocking(conn, &req, &call);
-    if (err) goto err1;
+    return r < 0 ? -errno : r;
+}
 
-    err1: castle_shared_buffer_destroy(conn, buf, value_len);
-    err0: return err;
+int castle_big_put_fd(castle_connection *conn,
+                      c_collection_id_t collection,
+                      castle_key *key,
+                      int fd,
+                      uint64_t val_length)
+{
+    return castle_big_put_stream(conn, collection, key, fd_reader, &fd, val_length);
 }
 
 int castle_big_get(castle_connection *conn,
@@ -822,6 +1679,10 @@ int castle_big_get(castle_connection *conn,
 
     *token_out = 0;
 
+    /* Must see the connection's own buffered writes. */
+    err = castle_write_behind_flush(conn);
+    if (err) goto err0;
+
     err = make_key_buffer(conn, key, 0, &key_buf, &key_len);
     if (err) goto err0;
 
@@ -873,6 +1734,604 @@ int castle_get_chunk(castle_connection *conn,
     err0: return err;
 }
 
+/* Number of get_chunk requests castle_big_get_to_fd() keeps in flight. */
+#define BIG_GET_STREAM_DEPTH 3
+
+static int write_full_iov(int fd, struct iovec *iov, int iov_count)
+{
+    while (iov_count > 0)
+    {
+        ssize_t r = writev(fd, iov, iov_count);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        while (r > 0)
+        {
+            if ((size_t)r >= iov->iov_len)
+            {
+                r -= iov->iov_len;
+                iov++;
+                iov_count--;
+            }
+            else
+            {
+                iov->iov_base = (char *)iov->iov_base + r;
+                iov->iov_len -= r;
+                r = 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Read a value of any size and write it to a file descriptor.
+ *
+ * Up to BIG_GET_STREAM_DEPTH get_chunk requests are kept in flight, each into
+ * its own shared buffer, and completed chunks are written to fd directly from
+ * those buffers (several at once with writev() when they are ready together).
+ * Memory use is bounded by the buffers regardless of the size of the value.
+ *
+ * A big_get can't be cancelled, only read to the end.  If writing to fd fails,
+ * the rest of the value is still read, and thrown away, so that the kernel
+ * releases the token.
+ *
+ * @param   [out]   value_len_out   Length of the value written to fd
+ *
+ * @return  The error from writev(), or the negated error of the request that
+ *          failed
+ */
+int castle_big_get_to_fd(castle_connection *conn,
+                         c_collection_id_t collection,
+                         castle_key *key,
+                         int fd,
+                         uint64_t *value_len_out)
+{
+    struct castle_blocking_call calls[BIG_GET_STREAM_DEPTH];
+    struct iovec iov[BIG_GET_STREAM_DEPTH];
+    char *bufs[BIG_GET_STREAM_DEPTH];
+    castle_request_t req;
+    castle_interface_token_t token;
+    uint64_t val_len, received = 0;
+    int depth = 0, head = 0, inflight = 0, err = 0;
+
+    /* One buffer is taken before the token, so the value can always be read
+     * to the end; more only deepen the pipeline. */
+    err = castle_shared_buffer_create(conn, &bufs[0], VALUE_LEN);
+    if (err) goto err0;
+    depth = 1;
+
+    err = castle_big_get(conn, collection, key, &token, &val_len);
+    if (err) goto err2;
+
+    while (depth < BIG_GET_STREAM_DEPTH && (uint64_t)depth * VALUE_LEN < val_len
+            && !castle_shared_buffer_create(conn, &bufs[depth], VALUE_LEN))
+        depth++;
+
+    while (received < val_len)
+    {
+        int count = 0;
+
+        /* Never ask for more chunks than the remainder of the value can fill. */
+        while (inflight < depth && received + (uint64_t)inflight * VALUE_LEN < val_len)
+        {
+            int slot = (head + inflight) % depth;
+            castle_get_chunk_prepare(&req, token, bufs[slot], VALUE_LEN, CASTLE_RING_FLAG_NONE);
+            castle_request_submit(conn, &req, &calls[slot], 1);
+            inflight++;
+        }
+
+        /* Wait for the oldest chunk, then pick up any later ones that are done too. */
+        do {
+            int slot = (head + count) % depth;
+
+            if (count > 0 && !castle_request_poll(conn, &calls[slot]))
+                break;
+
+            err = castle_request_wait(conn, &calls[slot]);
+            if (!err && (calls[slot].length == 0 || calls[slot].length > VALUE_LEN))
+                err = -EIO;
+            if (err)
+            {
+                /* The kernel has dropped the big_get; collect what is in flight. */
+                head = (head + count + 1) % depth;
+                inflight -= count + 1;
+                goto err1;
+            }
+
+            iov[count].iov_base = bufs[slot];
+            iov[count].iov_len = calls[slot].length;
+            received += calls[slot].length;
+        } while (++count < inflight);
+
+        err = write_full_iov(fd, iov, count);
+
+        head = (head + count) % depth;
+        inflight -= count;
+
+        if (err) goto drain;
+    }
+
+    *value_len_out = val_len;
+    goto err1;
+
+drain:
+    /* Read the rest of the value into the buffers and drop it. */
+    while (inflight > 0 || received < val_len)
+    {
+        int slot;
+
+        while (inflight < depth && received + (uint64_t)inflight * VALUE_LEN < val_len)
+        {
+            slot = (head + inflight) % depth;
+            castle_get_chunk_prepare(&req, token, bufs[slot], VALUE_LEN, CASTLE_RING_FLAG_NONE);
+            castle_request_submit(conn, &req, &calls[slot], 1);
+            inflight++;
+        }
+
+        slot = head;
+        head = (head + 1) % depth;
+        inflight--;
+        if (castle_request_wait(conn, &calls[slot]) || calls[slot].length == 0)
+            break;
+        received += calls[slot].length;
+    }
+
+err1:
+    while (inflight-- > 0)
+    {
+        castle_request_wait(conn, &calls[head]);
+        head = (head + 1) % depth;
+    }
+err2:
+    for (int i = 0; i < depth; i++)
+        castle_shared_buffer_destroy(conn, bufs[i], VALUE_LEN);
+err0:
+    return stream_err(err);
+}
+
+/* Space reserved for each value by castle_get_multi(); longer values are
+ * fetched with a follow-up big_get. */
+#define GET_MULTI_VALUE_SLOT PAGE_SIZE
+/* Keys and values packed into arenas are padded to this alignment. */
+#define ARENA_ALIGN 8
+#define arena_space(_len) (((_len) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/* Shared buffers holding the keys and value slots for a run of requests. */
+struct get_multi_arena
+{
+    char     *key_buf;
+    uint32_t  key_buf_len;
+    char     *val_buf;
+    uint32_t  val_buf_len;
+};
+
+/* Read all chunks of a big_get into value, using buf as the shared chunk
+ * buffer.  A NULL value reads them and throws them away. */
+static int big_get_read(castle_connection *conn, castle_interface_token_t token,
+                        char *value, uint64_t val_len, char *buf)
+{
+    struct castle_blocking_call call;
+    castle_request_t req;
+    uint64_t done = 0;
+    int err;
+
+    while (done < val_len)
+    {
+        castle_get_chunk_prepare(&req, token, buf, VALUE_LEN, CASTLE_RING_FLAG_NONE);
+
+        err = castle_request_do_blocking(conn, &req, &call);
+        if (err)
+            return err;
+        if (call.length == 0 || call.length > val_len - done)
+            return -EIO;
+
+        if (value)
+            memcpy(value + done, buf, call.length);
+        done += call.length;
+    }
+
+    return 0;
+}
+
+/**
+ * Get many keys from a collection at once.
+ *
+ * The keys are packed into shared arenas, each with a GET_MULTI_VALUE_SLOT
+ * value slot per key, and all the gets are put on the ring with a single
+ * castle_request_send() so the kernel is only poked once.  Values that don't
+ * fit in their slot are fetched afterwards with big_get, only for those keys,
+ * one at a time.
+ *
+ * Values are copied into a single heap allocation returned in *arena_out,
+ * which the caller releases with free().  results[i].value points into it.
+ *
+ * @param   [out]   results     Per-key value and error (e.g. -ENOENT)
+ *
+ * @return  0 if every get was attempted, otherwise an error and no results
+ */
+int castle_get_multi(castle_connection *conn,
+                     c_collection_id_t collection,
+                     castle_key **keys,
+                     unsigned int count,
+                     struct castle_get_result *results,
+                     char **arena_out)
+{
+    struct castle_blocking_call *calls = NULL;
+    castle_request_t *reqs = NULL;
+    struct get_multi_arena *arenas = NULL;
+    uint64_t *lens = NULL;
+    uint32_t max_buf = castle_max_buffer_size();
+    uint32_t slots_per_arena = max_buf / GET_MULTI_VALUE_SLOT;
+    unsigned int nr_arenas = 0, a, i;
+    uint64_t total = 0;
+    char *arena = NULL, *chunk_buf = NULL;
+    int err = 0;
+
+    *arena_out = NULL;
+
+    if (count == 0)
+        return 0;
+
+    /* Must see the connection's own buffered writes. */
+    err = castle_write_behind_flush(conn);
+    if (err)
+        return err;
+
+    calls  = calloc(count, sizeof(*calls));
+    reqs   = calloc(count, sizeof(*reqs));
+    lens   = calloc(count, sizeof(*lens));
+    arenas = calloc(count, sizeof(*arenas));
+    if (!calls || !reqs || !lens || !arenas)
+    {
+        err = -ENOMEM;
+        goto out0;
+    }
+
+    /* Size the arenas: each takes keys until its key or value space runs out. */
+    for (i = 0; i < count; )
+    {
+        struct get_multi_arena *cur = &arenas[nr_arenas++];
+        unsigned int nr_keys = 0;
+
+        while (i < count && nr_keys < slots_per_arena)
+        {
+            uint32_t key_space = arena_space(castle_key_buffer_len(keys[i]));
+            if (nr_keys > 0 && cur->key_buf_len + key_space > max_buf)
+                break;
+            cur->key_buf_len += key_space;
+            nr_keys++;
+            i++;
+        }
+        cur->val_buf_len = nr_keys * GET_MULTI_VALUE_SLOT;
+    }
+
+    for (a = 0; a < nr_arenas; a++)
+    {
+        err = castle_shared_buffer_get(conn, arenas[a].key_buf_len, &arenas[a].key_buf);
+        if (err) goto out1;
+        err = castle_shared_buffer_get(conn, arenas[a].val_buf_len, &arenas[a].val_buf);
+        if (err)
+        {
+            castle_shared_buffer_put(conn, arenas[a].key_buf, arenas[a].key_buf_len);
+            goto out1;
+        }
+    }
+
+    /* Pack the keys and build the requests. */
+    {
+        uint32_t key_off = 0, slot = 0;
+
+        for (i = 0, a = 0; i < count; i++)
+        {
+            uint32_t key_len = castle_key_buffer_len(keys[i]);
+
+            if (slot * GET_MULTI_VALUE_SLOT == arenas[a].val_buf_len)
+            {
+                a++;
+                key_off = 0;
+                slot = 0;
+            }
+
+            castle_key_buffer_fill(keys[i], arenas[a].key_buf + key_off, key_len);
+            castle_get_prepare(&reqs[i],
+                               collection,
+                               (castle_key *) (arenas[a].key_buf + key_off),
+                               key_len,
+                               arenas[a].val_buf + slot * GET_MULTI_VALUE_SLOT,
+                               GET_MULTI_VALUE_SLOT,
+                               CASTLE_RING_FLAG_NONE);
+
+            key_off += arena_space(key_len);
+            slot++;
+        }
+    }
+
+    castle_request_submit(conn, reqs, calls, count);
+
+    for (i = 0; i < count; i++)
+        castle_request_wait(conn, &calls[i]);
+
+    /* Size the result arena from the lengths the gets reported, oversize values included. */
+    for (i = 0; i < count; i++)
+    {
+        results[i].err = calls[i].err;
+        results[i].value = NULL;
+        results[i].value_len = 0;
+        if (results[i].err)
+            continue;
+
+        if (calls[i].length > UINT32_MAX)
+        {
+            results[i].err = -EFBIG;
+            continue;
+        }
+
+        lens[i] = calls[i].length;
+        total += lens[i];
+    }
+
+    arena = malloc(total ? total : 1);
+    if (!arena)
+    {
+        err = -ENOMEM;
+        goto out2;
+    }
+
+    {
+        uint64_t off = 0;
+
+        for (i = 0; i < count; i++)
+        {
+            if (results[i].err)
+                continue;
+
+            results[i].value = arena + off;
+            results[i].value_len = lens[i];
+
+            if (lens[i] > GET_MULTI_VALUE_SLOT)
+            {
+                /* Fetch oversize values one big_get at a time, each read to
+                 * the end before the next is opened, so a batch holds at most
+                 * one stateful op. */
+                castle_interface_token_t token;
+                uint64_t big_len;
+
+                if (!chunk_buf)
+                {
+                    err = castle_shared_buffer_get(conn, VALUE_LEN, &chunk_buf);
+                    if (err) goto out3;
+                }
+
+                results[i].err = castle_big_get(conn, collection, keys[i], &token, &big_len);
+                if (!results[i].err)
+                {
+                    /* The value may have changed since the get; read a longer
+                     * one to the end anyway, to release the token. */
+                    results[i].err = big_get_read(conn, token, big_len > lens[i] ? NULL : arena + off,
+                                                  big_len, chunk_buf);
+                    if (!results[i].err && big_len > lens[i])
+                        results[i].err = -EAGAIN;
+                    results[i].value_len = big_len;
+                }
+                if (results[i].err)
+                {
+                    results[i].value = NULL;
+                    results[i].value_len = 0;
+                }
+            }
+            else
+                memcpy(arena + off, (char *) reqs[i].get.value_ptr, lens[i]);
+
+            off += lens[i];
+        }
+    }
+
+    *arena_out = arena;
+    arena = NULL;
+
+out3:
+    free(arena);
+    if (chunk_buf)
+        castle_shared_buffer_put(conn, chunk_buf, VALUE_LEN);
+out2:
+    a = nr_arenas;
+out1:
+    while (a-- > 0)
+    {
+        castle_shared_buffer_put(conn, arenas[a].val_buf, arenas[a].val_buf_len);
+        castle_shared_buffer_put(conn, arenas[a].key_buf, arenas[a].key_buf_len);
+    }
+out0:
+    free(arenas);
+    free(lens);
+    free(reqs);
+    free(calls);
+    return err;
+}
+
+/* Requests castle_write_multi() puts on the ring with each doorbell. */
+#define WRITE_MULTI_WINDOW 128
+
+static int write_op_has_value(const struct castle_write_op *op)
+{
+    return op->type != CASTLE_WRITE_REMOVE && op->type != CASTLE_WRITE_TIMESTAMPED_REMOVE;
+}
+
+static uint32_t write_op_space(const struct castle_write_op *op)
+{
+    uint32_t space = arena_space(castle_key_buffer_len(op->key));
+
+    if (write_op_has_value(op))
+        space += arena_space(op->value_len);
+
+    return space;
+}
+
+/*
+ * Send ops, bypassing write-behind; castle_write_multi() itself, and the
+ * write-behind flusher.  Every op must have a valid type.
+ *
+ * Keys and values for up to WRITE_MULTI_WINDOW operations at a time are
+ * packed into one shared arena from the connection's buffer cache, and each
+ * window is put on the ring with a single castle_request_send().  The request
+ * and completion arrays live on the stack, so the steady state makes no heap
+ * allocations.  Operations within a batch may complete in any order.
+ */
+int castle_write_multi_send(castle_connection *conn,
+                            const struct castle_write_op *ops,
+                            unsigned int count,
+                            int *errs)
+{
+    castle_request_t reqs[WRITE_MULTI_WINDOW];
+    struct castle_blocking_call calls[WRITE_MULTI_WINDOW];
+    uint32_t max_buf = castle_max_buffer_size();
+    unsigned int first = 0, i, n;
+    int err = 0;
+
+    while (first < count)
+    {
+        uint32_t arena_len = 0, off = 0;
+        char *arena;
+        int ret;
+
+        /* Take operations until the window or the arena is full. */
+        for (n = 0; n < WRITE_MULTI_WINDOW && first + n < count; n++)
+        {
+            uint32_t space = write_op_space(&ops[first + n]);
+            if (n > 0 && arena_len + space > max_buf)
+                break;
+            arena_len += space;
+        }
+
+        ret = castle_shared_buffer_get(conn, arena_len, &arena);
+        if (ret)
+        {
+            for (i = first; i < count; i++)
+                errs[i] = ret;
+            return err ? err : ret;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            const struct castle_write_op *op = &ops[first + i];
+            uint32_t key_len = castle_key_buffer_len(op->key);
+            castle_key *key = (castle_key *) (arena + off);
+            char *val = NULL;
+
+            castle_key_buffer_fill(op->key, arena + off, key_len);
+            off += arena_space(key_len);
+            castle_key_written(op->collection, op->key);
+
+            if (write_op_has_value(op))
+            {
+                val = arena + off;
+                memcpy(val, op->value, op->value_len);
+                off += arena_space(op->value_len);
+            }
+
+            switch (op->type)
+            {
+                case CASTLE_WRITE_REPLACE:
+                    castle_replace_prepare(&reqs[i], op->collection, key, key_len,
+                                           val, op->value_len, CASTLE_RING_FLAG_NONE);
+                    break;
+                case CASTLE_WRITE_TIMESTAMPED_REPLACE:
+                    castle_timestamped_replace_prepare(&reqs[i], op->collection, key, key_len,
+                                                       val, op->value_len, op->user_timestamp,
+                                                       CASTLE_RING_FLAG_NONE);
+                    break;
+                case CASTLE_WRITE_REMOVE:
+                    castle_remove_prepare(&reqs[i], op->collection, key, key_len,
+                                          CASTLE_RING_FLAG_NONE);
+                    break;
+                case CASTLE_WRITE_TIMESTAMPED_REMOVE:
+                    castle_timestamped_remove_prepare(&reqs[i], op->collection, key, key_len,
+                                                      op->user_timestamp, CASTLE_RING_FLAG_NONE);
+                    break;
+                case CASTLE_WRITE_COUNTER_SET:
+                    castle_counter_set_replace_prepare(&reqs[i], op->collection, key, key_len,
+                                                       val, op->value_len, CASTLE_RING_FLAG_NONE);
+                    break;
+                case CASTLE_WRITE_COUNTER_ADD:
+                    castle_counter_add_replace_prepare(&reqs[i], op->collection, key, key_len,
+                                                       val, op->value_len, CASTLE_RING_FLAG_NONE);
+                    break;
+            }
+        }
+
+        castle_request_submit(conn, reqs, calls, n);
+
+        for (i = 0; i < n; i++)
+        {
+            errs[first + i] = castle_request_wait(conn, &calls[i]);
+            if (!err)
+                err = errs[first + i];
+            castle_key_written(ops[first + i].collection, ops[first + i].key);
+        }
+
+        castle_shared_buffer_put(conn, arena, arena_len);
+        first += n;
+    }
+
+    return err;
+}
+
+/**
+ * Apply a batch of replace, remove and counter operations.
+ *
+ * Writes buffered by write-behind on conn are flushed first, so that the batch
+ * is applied after them.
+ *
+ * @param   [out]   errs    Per-operation result, 0 on success
+ *
+ * @return  0 if every operation succeeded, otherwise the first error in errs
+ * @return -EINVAL  An operation has an unknown type, and nothing was sent; errs
+ *                  is -EINVAL for those operations and 0 for the rest
+ */
+int castle_write_multi(castle_connection *conn,
+                       const struct castle_write_op *ops,
+                       unsigned int count,
+                       int *errs)
+{
+    unsigned int i;
+    int err = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        switch (ops[i].type)
+        {
+            case CASTLE_WRITE_REPLACE:
+            case CASTLE_WRITE_TIMESTAMPED_REPLACE:
+            case CASTLE_WRITE_REMOVE:
+            case CASTLE_WRITE_TIMESTAMPED_REMOVE:
+            case CASTLE_WRITE_COUNTER_SET:
+            case CASTLE_WRITE_COUNTER_ADD:
+                errs[i] = 0;
+                break;
+            default:
+                errs[i] = err = -EINVAL;
+        }
+    }
+    if (err)
+        return err;
+
+    err = castle_write_behind_flush(conn);
+    if (err)
+    {
+        for (i = 0; i < count; i++)
+            errs[i] = err;
+        return err;
+    }
+
+    return castle_write_multi_send(conn, ops, count, errs);
+}
+
 uint32_t castle_device_to_devno(const char *filename)
 {
     struct stat st;
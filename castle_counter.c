@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "castle.h"
+#include "castle_private.h"
+
+/*
+ * Counter accumulators.
+ *
+ * Deltas added to an accumulator are summed per (collection, key) in a
+ * sharded hash table rather than each being sent as a COUNTER_REPLACE.  The
+ * sums are written out as counter adds with castle_write_multi() by a flusher
+ * thread every max_delay_ms, or sooner once max_keys distinct keys are
+ * pending, so a delta reaches the kernel within roughly max_delay_ms of being
+ * added.  castle_counter_acc_flush() is a barrier: every delta added before
+ * it is called has been applied when it returns.
+ *
+ * Counters are 64-bit and deltas are sent in host byte order, as
+ * castle_counter_add_replace_prepare() expects.
+ */
+
+#define CASTLE_COUNTER_SHARDS       16
+#define CASTLE_COUNTER_BUCKETS      1024    /* per shard */
+#define CASTLE_COUNTER_FLUSH_BATCH  512
+
+struct castle_counter_entry
+{
+    struct castle_counter_entry *next;
+    c_collection_id_t            collection;
+    uint32_t                     hash;
+    int64_t                      delta;
+    castle_key                  *key;       /**< Copy of the key, following the entry       */
+};
+
+struct castle_counter_shard
+{
+    pthread_mutex_t               lock;
+    struct castle_counter_entry  *buckets[CASTLE_COUNTER_BUCKETS];
+};
+
+struct castle_counter_acc
+{
+    castle_connection            *conn;
+    unsigned int                  max_keys;
+    unsigned int                  max_delay_ms;
+
+    struct castle_counter_shard   shards[CASTLE_COUNTER_SHARDS];
+    unsigned int                  nr_keys;  /**< Distinct keys pending, across all shards  */
+
+    pthread_mutex_t               flush_lock;   /**< Serialises flushes                      */
+    pthread_mutex_t               lock;
+    pthread_cond_t                cond;
+    pthread_t                     flusher;
+    int                           kick;
+    int                           exit;
+    int                           err;      /**< First error from a background flush       */
+};
+
+/* Write out a list of entries, freeing them.  Returns the first error. */
+static int castle_counter_write(castle_counter_acc *acc, struct castle_counter_entry *list)
+{
+    struct castle_write_op ops[CASTLE_COUNTER_FLUSH_BATCH];
+    struct castle_counter_entry *batch[CASTLE_COUNTER_FLUSH_BATCH];
+    int errs[CASTLE_COUNTER_FLUSH_BATCH];
+    unsigned int n, i;
+    int err = 0, ret;
+
+    while (list)
+    {
+        for (n = 0; list && n < CASTLE_COUNTER_FLUSH_BATCH; list = list->next)
+        {
+            batch[n] = list;
+            ops[n].type = CASTLE_WRITE_COUNTER_ADD;
+            ops[n].collection = list->collection;
+            ops[n].key = list->key;
+            ops[n].value = (const char *)&list->delta;
+            ops[n].value_len = sizeof(list->delta);
+            ops[n].user_timestamp = 0;
+            n++;
+        }
+
+        ret = castle_write_multi(acc->conn, ops, n, errs);
+        if (ret && !err)
+            err = ret;
+
+        for (i = 0; i < n; i++)
+            free(batch[i]);
+    }
+
+    return err;
+}
+
+/* Detach everything pending and write it out. */
+static int castle_counter_flush_locked(castle_counter_acc *acc)
+{
+    struct castle_counter_entry *list = NULL, *entry, *next;
+    int err;
+
+    for (unsigned int s = 0; s < CASTLE_COUNTER_SHARDS; s++)
+    {
+        struct castle_counter_shard *shard = &acc->shards[s];
+
+        pthread_mutex_lock(&shard->lock);
+        for (unsigned int b = 0; b < CASTLE_COUNTER_BUCKETS; b++)
+        {
+            for (entry = shard->buckets[b]; entry; entry = next)
+            {
+                next = entry->next;
+                __sync_fetch_and_sub(&acc->nr_keys, 1);
+                if (entry->delta == 0)
+                {
+                    free(entry);
+                    continue;
+                }
+                entry->next = list;
+                list = entry;
+            }
+            shard->buckets[b] = NULL;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    err = castle_counter_write(acc, list);
+
+    return err;
+}
+
+static void *castle_counter_flusher(void *data)
+{
+    castle_counter_acc *acc = data;
+    struct timespec deadline;
+    int stop, err;
+
+    for (;;)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += acc->max_delay_ms / 1000;
+        deadline.tv_nsec += (acc->max_delay_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&acc->lock);
+        while (!acc->kick && !acc->exit
+                && pthread_cond_timedwait(&acc->cond, &acc->lock, &deadline) != ETIMEDOUT);
+        acc->kick = 0;
+        stop = acc->exit;
+        pthread_mutex_unlock(&acc->lock);
+
+        if (stop)
+            break;
+
+        pthread_mutex_lock(&acc->flush_lock);
+        err = castle_counter_flush_locked(acc);
+        pthread_mutex_unlock(&acc->flush_lock);
+
+        if (err)
+        {
+            pthread_mutex_lock(&acc->lock);
+            if (!acc->err)
+                acc->err = err;
+            pthread_mutex_unlock(&acc->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Create a counter accumulator writing through conn.
+ *
+ * @param   max_keys        Flush once this many distinct keys are pending
+ * @param   max_delay_ms    Flush at least this often
+ */
+int castle_counter_acc_create(castle_connection *conn,
+                              unsigned int max_keys,
+                              unsigned int max_delay_ms,
+                              castle_counter_acc **acc_out)
+{
+    castle_counter_acc *acc;
+    unsigned int s;
+
+    *acc_out = NULL;
+
+    if (max_keys == 0 || max_delay_ms == 0)
+        return -EINVAL;
+
+    acc = calloc(1, sizeof(*acc));
+    if (!acc)
+        return -ENOMEM;
+
+    acc->conn = conn;
+    acc->max_keys = max_keys;
+    acc->max_delay_ms = max_delay_ms;
+    for (s = 0; s < CASTLE_COUNTER_SHARDS; s++)
+        pthread_mutex_init(&acc->shards[s].lock, NULL);
+    pthread_mutex_init(&acc->flush_lock, NULL);
+    pthread_mutex_init(&acc->lock, NULL);
+    pthread_cond_init(&acc->cond, NULL);
+
+    if (pthread_create(&acc->flusher, NULL, castle_counter_flusher, acc))
+    {
+        pthread_cond_destroy(&acc->cond);
+        pthread_mutex_destroy(&acc->lock);
+        pthread_mutex_destroy(&acc->flush_lock);
+        for (s = 0; s < CASTLE_COUNTER_SHARDS; s++)
+            pthread_mutex_destroy(&acc->shards[s].lock);
+        free(acc);
+        return -EAGAIN;
+    }
+
+    *acc_out = acc;
+
+    return 0;
+}
+
+/**
+ * Add delta to the counter at key.
+ *
+ * @return  0 on success, or the error from a failed background flush, in
+ *          which case the deltas it carried have been lost
+ */
+int castle_counter_acc_add(castle_counter_acc *acc,
+                           c_collection_id_t collection,
+                           castle_key *key,
+                           int64_t delta)
+{
+    uint32_t hash = castle_key_hash(key, collection);
+    struct castle_counter_shard *shard = &acc->shards[hash % CASTLE_COUNTER_SHARDS];
+    struct castle_counter_entry **bucket, *entry;
+    uint32_t key_len;
+    int err;
+
+    /* Set by the flusher under acc->lock. */
+    if ((err = __sync_fetch_and_add(&acc->err, 0)))
+        return err;
+
+    bucket = &shard->buckets[(hash / CASTLE_COUNTER_SHARDS) % CASTLE_COUNTER_BUCKETS];
+
+    pthread_mutex_lock(&shard->lock);
+    for (entry = *bucket; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->collection == collection
+                && castle_key_compare(entry->key, key) == 0)
+        {
+            entry->delta += delta;
+            pthread_mutex_unlock(&shard->lock);
+            return 0;
+        }
+    }
+
+    key_len = castle_key_length(key);
+    entry = malloc(sizeof(*entry) + key_len);
+    if (!entry)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        return -ENOMEM;
+    }
+    entry->collection = collection;
+    entry->hash = hash;
+    entry->delta = delta;
+    entry->key = (castle_key *)(entry + 1);
+    memcpy(entry->key, key, key_len);
+    entry->next = *bucket;
+    *bucket = entry;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (__sync_add_and_fetch(&acc->nr_keys, 1) == acc->max_keys)
+    {
+        pthread_mutex_lock(&acc->lock);
+        acc->kick = 1;
+        pthread_cond_signal(&acc->cond);
+        pthread_mutex_unlock(&acc->lock);
+    }
+
+    return 0;
+}
+
+/**
+ * Apply every delta added before the call.
+ *
+ * @return  The first error from this or an earlier background flush
+ */
+int castle_counter_acc_flush(castle_counter_acc *acc)
+{
+    int err;
+
+    /* Waits out a background flush that has already taken entries. */
+    pthread_mutex_lock(&acc->flush_lock);
+    err = castle_counter_flush_locked(acc);
+    pthread_mutex_unlock(&acc->flush_lock);
+
+    pthread_mutex_lock(&acc->lock);
+    if (!err)
+        err = acc->err;
+    acc->err = 0;
+    pthread_mutex_unlock(&acc->lock);
+
+    return err;
+}
+
+/**
+ * Flush and free an accumulator.
+ */
+int castle_counter_acc_destroy(castle_counter_acc *acc)
+{
+    int err;
+
+    pthread_mutex_lock(&acc->lock);
+    acc->exit = 1;
+    pthread_cond_signal(&acc->cond);
+    pthread_mutex_unlock(&acc->lock);
+    pthread_join(acc->flusher, NULL);
+
+    err = castle_counter_acc_flush(acc);
+
+    pthread_cond_destroy(&acc->cond);
+    pthread_mutex_destroy(&acc->lock);
+    pthread_mutex_destroy(&acc->flush_lock);
+    for (unsigned int s = 0; s < CASTLE_COUNTER_SHARDS; s++)
+        pthread_mutex_destroy(&acc->shards[s].lock);
+    free(acc);
+
+    return err;
+}
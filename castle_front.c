@@ -141,6 +141,10 @@ static void *castle_response_thread(void *data)
               memcpy(&last, &end, sizeof(last));
               fprintf(conn->debug_log, "ring free requests %d, reserved %d\n",
                       RING_FREE_REQUESTS(&conn->front_ring), conn->front_ring.reserved);
+              fprintf(conn->debug_log, "iter round trips %llu, entries %llu, bytes %llu\n",
+                      (unsigned long long)conn->iter_round_trips,
+                      (unsigned long long)conn->iter_entries,
+                      (unsigned long long)conn->iter_bytes);
               fflush(conn->debug_log);
             }
           }
@@ -221,6 +225,97 @@ int castle_shared_buffer_release(castle_connection *conn, castle_buffer* buffer)
     return rc;
 }
 
+/* Size class for a buffer of size bytes, or -1 if it is too big to cache. */
+static int buffer_cache_class(unsigned long size)
+{
+    int class = 0;
+
+    while (class < CASTLE_BUFFER_CACHE_CLASSES && ((unsigned long)PAGE_SIZE << class) < size)
+        class++;
+
+    return class < CASTLE_BUFFER_CACHE_CLASSES ? class : -1;
+}
+
+/**
+ * Get a shared buffer of at least size bytes, reusing one from the
+ * connection's cache when possible.  Must be returned with
+ * castle_shared_buffer_put() passing the same size.
+ *
+ * This is separate from castle_shared_pool, which the convenience calls can't
+ * use: a pool is created by the application with fixed sizes and counts, is
+ * not attached to the connection, and castle_shared_pool_lease() waits for a
+ * buffer to be released when the pool is empty, which would deadlock an async
+ * call made from a callback.  The cache instead never waits, falling back to
+ * castle_shared_buffer_create() when empty.
+ */
+int castle_shared_buffer_get(castle_connection *conn, unsigned long size, char **buffer_out)
+{
+    int class = buffer_cache_class(size);
+    char *buffer = NULL;
+
+    if (class < 0)
+        return castle_shared_buffer_create(conn, buffer_out, size);
+
+    pthread_mutex_lock(&conn->buffer_cache_mutex);
+    if (conn->buffer_cache[class])
+    {
+        buffer = conn->buffer_cache[class];
+        conn->buffer_cache[class] = *(char **)buffer;
+        conn->buffer_cache_count[class]--;
+    }
+    pthread_mutex_unlock(&conn->buffer_cache_mutex);
+
+    if (buffer)
+    {
+        *buffer_out = buffer;
+        return 0;
+    }
+
+    return castle_shared_buffer_create(conn, buffer_out, (unsigned long)PAGE_SIZE << class);
+}
+
+void castle_shared_buffer_put(castle_connection *conn, char *buffer, unsigned long size)
+{
+    int class = buffer_cache_class(size);
+    unsigned long class_size;
+
+    if (class < 0)
+    {
+        castle_shared_buffer_destroy(conn, buffer, size);
+        return;
+    }
+
+    class_size = (unsigned long)PAGE_SIZE << class;
+
+    pthread_mutex_lock(&conn->buffer_cache_mutex);
+    if ((conn->buffer_cache_count[class] + 1) * class_size <= CASTLE_BUFFER_CACHE_CLASS_BYTES
+            || conn->buffer_cache_count[class] < 2)
+    {
+        *(char **)buffer = conn->buffer_cache[class];
+        conn->buffer_cache[class] = buffer;
+        conn->buffer_cache_count[class]++;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&conn->buffer_cache_mutex);
+
+    if (buffer)
+        castle_shared_buffer_destroy(conn, buffer, class_size);
+}
+
+static void buffer_cache_drain(castle_connection *conn)
+{
+    for (int class = 0; class < CASTLE_BUFFER_CACHE_CLASSES; class++)
+    {
+        while (conn->buffer_cache[class])
+        {
+            char *buffer = conn->buffer_cache[class];
+            conn->buffer_cache[class] = *(char **)buffer;
+            castle_shared_buffer_destroy(conn, buffer, (unsigned long)PAGE_SIZE << class);
+        }
+        conn->buffer_cache_count[class] = 0;
+    }
+}
+
 static int set_non_blocking(int fd)
 {
     int flags;
@@ -292,7 +387,7 @@ int castle_connect(castle_connection **conn_out)
     for (unsigned int i=0; i<RING_SIZE(&conn->front_ring); i++)
         list_add(&conn->callbacks[i].list, &conn->free_callbacks);
 
-    err = pthread_mutex_init(&conn->free_mutex, NULL);
+    err = pthread_mutex_init(&conn->buffer_cache_mutex, NULL);
     if (err)
     {
         debug("Failed to create mutex, err=%d\n", err);
@@ -300,13 +395,21 @@ int castle_connect(castle_connection **conn_out)
         goto err4;
     }
 
-    err = pthread_mutex_init(&conn->ring_mutex, NULL);
+    err = pthread_mutex_init(&conn->free_mutex, NULL);
     if (err)
     {
         debug("Failed to create mutex, err=%d\n", err);
         err = -err;
         goto err5;
     }
+
+    err = pthread_mutex_init(&conn->ring_mutex, NULL);
+    if (err)
+    {
+        debug("Failed to create mutex, err=%d\n", err);
+        err = -err;
+        goto err6;
+    }
     debug("Initialised mutex\n");
 
     err = pthread_cond_init(&conn->ring_cond, NULL);
@@ -314,7 +417,7 @@ int castle_connect(castle_connection **conn_out)
     {
         debug("Failed to create condition, err=%d\n", err);
         err = -err;
-        goto err6;
+        goto err7;
     }
     debug("Initialise condition\n");
 
@@ -323,7 +426,7 @@ int castle_connect(castle_connection **conn_out)
         debug("Failed to create pipe to unblock select, errno=%d (\"%s\")",
             errno, strerror(errno));
         err = -errno;
-        goto err7;
+        goto err8;
     }
 
     if (set_non_blocking(conn->select_pipe[0]) == -1)
@@ -331,7 +434,7 @@ int castle_connect(castle_connection **conn_out)
         debug("Failed to set non-block on fd %d, errno=%d (\"%s\")",
             conn->select_pipe[0], errno, strerror(errno));
         err = -errno;
-        goto err8;
+        goto err9;
     }
 
     if (set_non_blocking(conn->select_pipe[1]) == -1)
@@ -339,7 +442,7 @@ int castle_connect(castle_connection **conn_out)
         debug("Failed to set non-block on fd %d, errno=%d (\"%s\")",
             conn->select_pipe[1], errno, strerror(errno));
         err = -errno;
-        goto err8;
+        goto err9;
     }
 
     {
@@ -385,7 +488,7 @@ int castle_connect(castle_connection **conn_out)
     {
         debug("Failed to create response thread, err=%d\n", err);
         err = -err;
-        goto err9;
+        goto err10;
     }
     debug("Response thread started\n");
 
@@ -393,11 +496,12 @@ int castle_connect(castle_connection **conn_out)
 
     return 0;
 
-err9: fclose(conn->debug_log);
-err8: close(conn->select_pipe[0]); close(conn->select_pipe[1]);
-err7: pthread_cond_destroy(&conn->ring_cond);
-err6: pthread_mutex_destroy(&conn->ring_mutex);
-err5: pthread_mutex_destroy(&conn->free_mutex);
+err10: fclose(conn->debug_log);
+err9: close(conn->select_pipe[0]); close(conn->select_pipe[1]);
+err8: pthread_cond_destroy(&conn->ring_cond);
+err7: pthread_mutex_destroy(&conn->ring_mutex);
+err6: pthread_mutex_destroy(&conn->free_mutex);
+err5: pthread_mutex_destroy(&conn->buffer_cache_mutex);
 err4: free(conn->callbacks);
 err3: munmap(conn->shared_ring, CASTLE_RING_SIZE);
 err2: close(conn->fd);
@@ -453,12 +557,18 @@ void castle_free(castle_connection *conn)
     if (!conn)
       return;
 
+    if (conn->write_behind)
+      castle_write_behind_disable(conn);
+
     if (conn->fd >= 0)
       castle_disconnect(conn);
 
+    buffer_cache_drain(conn);
+
     pthread_cond_destroy(&conn->ring_cond);
     pthread_mutex_destroy(&conn->ring_mutex);
     pthread_mutex_destroy(&conn->free_mutex);
+    pthread_mutex_destroy(&conn->buffer_cache_mutex);
     free(conn->callbacks);
     free(conn);
 }
@@ -474,6 +584,10 @@ get_request_token(castle_request_t *req) {
     return req->put_chunk.token;
   case CASTLE_RING_GET_CHUNK:
     return req->get_chunk.token;
+  case CASTLE_RING_STREAM_IN_NEXT:
+    return req->stream_in_next.token;
+  case CASTLE_RING_STREAM_IN_FINISH:
+    return req->stream_in_finish.token;
   default:
     return 0;
   }
@@ -497,108 +611,100 @@ ring_full_for(castle_connection *conn, castle_request_t *req) {
   return space <= reserved;
 }
 
-typedef struct
+/*
+ * Put one request on the ring.  The caller holds ring_mutex and has checked
+ * that there is space for it with ring_full_for(), and pushes the requests
+ * to the kernel afterwards.
+ */
+static void ring_put_request_locked(castle_connection *conn,
+                                    castle_request_t *req,
+                                    castle_callback callback_fn,
+                                    void *data)
 {
-    castle_callback callback;
-    void* userdata;
-    uint32_t remaining;
-    uint32_t err;
-} castle_batch_userdata;
+    struct castle_front_callback *callback;
+    int call_id;
+
+    pthread_mutex_lock(&conn->free_mutex);
+    assert(!list_empty(&conn->free_callbacks));
+    callback = list_entry(conn->free_callbacks.next, struct castle_front_callback, list);
+    list_del(&callback->list);
+    pthread_mutex_unlock(&conn->free_mutex);
+
+    call_id = callback - conn->callbacks;
+    req->call_id = call_id;
+
+    callback->callback = callback_fn;
+    callback->data = data;
+    callback->token = get_request_token(req);
+
+    if (want_debug(conn, DEBUG_REQS)) {
+      flockfile(conn->debug_log);
+      castle_print_request(conn->debug_log, req, conn->debug_flags & DEBUG_VALUES);
+      fprintf(conn->debug_log, "\n");
+      fflush(conn->debug_log);
+      funlockfile(conn->debug_log);
+    }
 
-static void castle_batch_callback(
-        castle_connection* conn __attribute__((unused)),
-        castle_response_t* resp,
-        void* userdata
-)
-{
-    castle_batch_userdata* data = (castle_batch_userdata*)userdata;
+    if (callback->token) {
+      /* If this request has a token it must be part of an ongoing stateful_op.
+       * As there are a fixed number of stateful_ops we store the number of
+       * outstanding sub-ops in the conn->outstanding_stateful_requests[] array.
+       * If we increment that count here and it was previously 0 (no pending
+       * sub-ops) then we expect to find our reserved slot on the ring. */
+      unsigned int x = callback->token % CASTLE_STATEFUL_OPS;
+      assert(x < CASTLE_STATEFUL_OPS);
+      int old = __sync_fetch_and_add(&conn->outstanding_stateful_requests[x], 1);
+      if (old == 0)
+        atomic_dec(&conn->front_ring.reserved);
+    }
 
-    // set the error and ignore any conflict
-    if (!data->err && resp->err)
-        __sync_val_compare_and_swap(&data->err, 0, resp->err);
+    /* More req_prod_pvt hazards */
+    castle_request_t *ring_req = RING_GET_REQUEST(&conn->front_ring, conn->front_ring.req_prod_pvt);
+    debug("Putting request %d at position %d\n", call_id, conn->front_ring.req_prod_pvt);
+    conn->front_ring.req_prod_pvt++;
 
-    uint32_t remaining = __sync_sub_and_fetch(&data->remaining, 1);
-    if (!remaining)
-    {
-        resp->err = data->err;
-        data->callback(conn, resp, data->userdata);
-        free(data);
-    }
+    memcpy(ring_req, req, sizeof(*ring_req));
 }
 
-int castle_request_send_batch(
-        castle_connection *conn,
-        castle_request *req,
-        castle_callback callback,
-        void *userdata,
-        int reqs_count
-)
+/* Push requests put on the ring to the kernel, poking it if necessary.  Caller holds ring_mutex. */
+static void ring_push_requests_locked(castle_connection *conn)
 {
-    int err = 0;
-    castle_batch_userdata* data = NULL;
-    castle_callback* callbacks = NULL;
-    void** userdatas = NULL;
+    int notify;
 
-    if (reqs_count > 1)
-    {
-        data = calloc(1, sizeof(*data));
-        if (!data)
-        {
-            err = -ENOMEM;
-            goto out0;
-        }
-        data->callback = callback;
-        data->userdata = userdata;
-        data->remaining = reqs_count;
+    /* This uses req_prod (safe due to strict ordering guarantees) and req_prod_pvt (hazard) */
+    RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&conn->front_ring, notify);
 
-        userdatas = calloc(reqs_count, sizeof(*userdatas));
-        if (!userdatas)
-        {
-            err = -ENOMEM;
-            goto err0;
-        }
-        callbacks = calloc(reqs_count, sizeof(*callbacks));
-        if (!callbacks)
-        {
-            err = -ENOMEM;
-            goto err0;
-        }
+    debug("notify=%d\n", notify);
 
-        for (int i = 0; i < reqs_count; ++i)
-        {
-            callbacks[i] = &castle_batch_callback;
-            userdatas[i] = data;
-        }
-    } else
+    if (notify)
     {
-        callbacks = &callback;
-        userdatas = &userdata;
-    }
-
-    castle_request_send(conn, req, callbacks, userdatas, reqs_count);
-    goto out1;
-
-err0:
-    free(data);
-out1:
-    if (reqs_count > 1)
-    {
-        free(callbacks);
-        free(userdatas);
+#ifdef TRACE
+        ioctls_counter++;
+#endif
+        ioctl(conn->fd, CASTLE_IOCTL_POKE_RING);
     }
-out0:
-    return err;
 }
 
-void castle_request_send(castle_connection *conn,
-                         castle_request_t *req,
-                         castle_callback *callbacks,
-                         void **datas,
-                         int reqs_count)
+/**
+ * Put requests on the ring.
+ *
+ * Completion callbacks are taken from callbacks[i] when the array is supplied,
+ * otherwise every request gets the single callback.  Likewise userdata comes
+ * from datas[i], or else from data + i * data_stride (a zero stride hands the
+ * same userdata to every request).  This lets internal callers submit large
+ * batches without building per-request arrays.
+ */
+static void castle_request_send_common(castle_connection *conn,
+                                       castle_request_t *req,
+                                       castle_callback *callbacks,
+                                       void **datas,
+                                       castle_callback single_callback,
+                                       void *data,
+                                       size_t data_stride,
+                                       int reqs_count)
 {
     // TODO check return codes?
-    int notify, i=0, call_id;
-    struct castle_front_callback *callback;
+    int i=0;
 
     /* This mutex is currently being abused for two distinct purposes,
        creating false scheduling hazards: it is both the condition
@@ -631,65 +737,123 @@ void castle_request_send(castle_connection *conn,
       /* Another RING_FULL hazard on req_prod_pvt */
       while (i < reqs_count && !ring_full_for(conn, &req[i]))
       {
-            pthread_mutex_lock(&conn->free_mutex);
-            assert(!list_empty(&conn->free_callbacks));
-            callback = list_entry(conn->free_callbacks.next, struct castle_front_callback, list);
-            list_del(&callback->list);
-            pthread_mutex_unlock(&conn->free_mutex);
+            void *req_data;
 
-            call_id = callback - conn->callbacks;
-            req[i].call_id = call_id;
+            if (datas)
+                req_data = datas[i];
+            else
+                req_data = data ? (char *)data + i * data_stride : NULL;
 
-            callback->callback = callbacks ? callbacks[i] : NULL;
-            callback->data = datas ? datas[i] : NULL;
-            callback->token = get_request_token(&req[i]);
+            ring_put_request_locked(conn, &req[i],
+                                    callbacks ? callbacks[i] : single_callback,
+                                    req_data);
 
-            if (want_debug(conn, DEBUG_REQS)) {
-              flockfile(conn->debug_log);
-              castle_print_request(conn->debug_log, &req[i], conn->debug_flags & DEBUG_VALUES);
-              fprintf(conn->debug_log, "\n");
-              fflush(conn->debug_log);
-              funlockfile(conn->debug_log);
-            }
+            i++;
+        }
 
-            if (callback->token) {
-              /* If this request has a token it must be part of an ongoing stateful_op.
-               * As there are a fixed number of stateful_ops we store the number of
-               * outstanding sub-ops in the conn->outstanding_stateful_requests[] array.
-               * If we increment that count here and it was previously 0 (no pending
-               * sub-ops) then we expect to find our reserved slot on the ring. */
-              unsigned int x = callback->token % CASTLE_STATEFUL_OPS;
-              assert(x < CASTLE_STATEFUL_OPS);
-              int old = __sync_fetch_and_add(&conn->outstanding_stateful_requests[x], 1);
-              if (old == 0)
-                atomic_dec(&conn->front_ring.reserved);
-            }
+        ring_push_requests_locked(conn);
+    }
 
-            /* More req_prod_pvt hazards */
-            castle_request_t *ring_req = RING_GET_REQUEST(&conn->front_ring, conn->front_ring.req_prod_pvt);
-            debug("Putting request %d at position %d\n", call_id, conn->front_ring.req_prod_pvt);
-            conn->front_ring.req_prod_pvt++;
+    pthread_mutex_unlock(&conn->ring_mutex);
+}
 
-            memcpy(ring_req, req + i, sizeof(*ring_req));
+/**
+ * Put a request on the ring if there is space for it right now.
+ *
+ * Unlike castle_request_send() this never waits for the ring to drain, so it
+ * is safe to call from a completion callback on the response thread.
+ *
+ * @return  -EAGAIN if the ring is full, -EUNATCH if the connection has gone
+ */
+int castle_request_send_nowait(castle_connection *conn,
+                               castle_request_t *req,
+                               castle_callback callback,
+                               void *data)
+{
+    int err = 0;
 
-            i++;
-        }
+    pthread_mutex_lock(&conn->ring_mutex);
 
-        /* This uses req_prod (safe due to strict ordering guarantees) and req_prod_pvt (hazard) */
-        RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&conn->front_ring, notify);
+    if (conn->fd < 0)
+        err = -EUNATCH;
+    else if (ring_full_for(conn, req))
+        err = -EAGAIN;
+    else
+    {
+        ring_put_request_locked(conn, req, callback, data);
+        ring_push_requests_locked(conn);
+    }
 
-        debug("notify=%d\n", notify);
+    pthread_mutex_unlock(&conn->ring_mutex);
 
-        if (notify)
-        {
-#ifdef TRACE
-            ioctls_counter++;
-#endif
-            ioctl(conn->fd, CASTLE_IOCTL_POKE_RING);
-        }
+    return err;
+}
+
+void castle_request_send(castle_connection *conn,
+                         castle_request_t *req,
+                         castle_callback *callbacks,
+                         void **datas,
+                         int reqs_count)
+{
+    castle_request_send_common(conn, req, callbacks, datas, NULL, NULL, 0, reqs_count);
+}
+
+typedef struct
+{
+    castle_callback callback;
+    void* userdata;
+    uint32_t remaining;
+    uint32_t err;
+} castle_batch_userdata;
+
+static void castle_batch_callback(
+        castle_connection* conn __attribute__((unused)),
+        castle_response_t* resp,
+        void* userdata
+)
+{
+    castle_batch_userdata* data = (castle_batch_userdata*)userdata;
+
+    // set the error and ignore any conflict
+    if (!data->err && resp->err)
+        __sync_val_compare_and_swap(&data->err, 0, resp->err);
+
+    uint32_t remaining = __sync_sub_and_fetch(&data->remaining, 1);
+    if (!remaining)
+    {
+        resp->err = data->err;
+        data->callback(conn, resp, data->userdata);
+        free(data);
     }
+}
 
-    pthread_mutex_unlock(&conn->ring_mutex);
+int castle_request_send_batch(
+        castle_connection *conn,
+        castle_request *req,
+        castle_callback callback,
+        void *userdata,
+        int reqs_count
+)
+{
+    castle_batch_userdata* data = NULL;
+
+    if (reqs_count <= 1)
+    {
+        castle_request_send(conn, req, &callback, &userdata, reqs_count);
+        return 0;
+    }
+
+    data = calloc(1, sizeof(*data));
+    if (!data)
+        return -ENOMEM;
+    data->callback = callback;
+    data->userdata = userdata;
+    data->remaining = reqs_count;
+
+    /* every request shares the one castle_batch_userdata */
+    castle_request_send_common(conn, req, NULL, NULL, &castle_batch_callback, data, 0, reqs_count);
+
+    return 0;
 }
 
 static void castle_blocking_callback(castle_connection *conn __attribute__((unused)),
@@ -709,21 +873,32 @@ static void castle_blocking_callback(castle_connection *conn __attribute__((unus
     pthread_mutex_unlock(&blocking_call_mutex);
 }
 
-int castle_request_do_blocking(castle_connection *conn,
-                               castle_request_t *req,
-                               struct castle_blocking_call *blocking_call)
+/**
+ * Put requests on the ring without waiting for them to complete.
+ *
+ * Each request completes into the matching element of blocking_calls, which
+ * must stay valid until castle_request_wait() has returned for it.  Used by
+ * the convenience layer to keep several requests in flight at once.
+ */
+void castle_request_submit(castle_connection *conn,
+                           castle_request_t *req,
+                           struct castle_blocking_call *blocking_calls,
+                           int count)
 {
-    /*
-     * Warning variables these will be on stack but used elsewhere, only safe as
-     * this function sleeps until they are finished with (see castle_blocking_callback)
-     */
-    void *blocking_calls = blocking_call;
-    castle_callback callback = &castle_blocking_callback;
+    for (int i = 0; i < count; i++)
+        blocking_calls[i].completed = 0;
 
-    blocking_call->completed = 0;
-
-    castle_request_send(conn, req, &callback, &blocking_calls, 1);
+    castle_request_send_common(conn, req, NULL, NULL, &castle_blocking_callback,
+                               blocking_calls, sizeof(*blocking_calls), count);
+}
 
+/**
+ * Wait for a request sent with castle_request_submit() to complete.
+ *
+ * @return  The error returned by the request, or EUNATCH if the connection went away.
+ */
+int castle_request_wait(castle_connection *conn, struct castle_blocking_call *blocking_call)
+{
     pthread_mutex_lock(&blocking_call_mutex);
     while (conn->fd >= 0 && !blocking_call->completed)
         pthread_cond_wait(&blocking_call_cond, &blocking_call_mutex);
@@ -737,43 +912,42 @@ int castle_request_do_blocking(castle_connection *conn,
     return blocking_call->err;
 }
 
+/**
+ * Check whether a request sent with castle_request_submit() has completed,
+ * without waiting for it.
+ */
+int castle_request_poll(castle_connection *conn __attribute__((unused)),
+                        struct castle_blocking_call *blocking_call)
+{
+    int completed;
+
+    pthread_mutex_lock(&blocking_call_mutex);
+    completed = blocking_call->completed;
+    pthread_mutex_unlock(&blocking_call_mutex);
+
+    return completed;
+}
+
+int castle_request_do_blocking(castle_connection *conn,
+                               castle_request_t *req,
+                               struct castle_blocking_call *blocking_call)
+{
+    castle_request_submit(conn, req, blocking_call, 1);
+
+    return castle_request_wait(conn, blocking_call);
+}
+
 int castle_request_do_blocking_multi(castle_connection *conn,
                                      castle_request_t *req,
                                      struct castle_blocking_call *blocking_call,
                                      int count)
 {
     int i;
-    void **blocking_calls;
-    castle_callback *callbacks;
-
-    blocking_calls = malloc(sizeof(struct castle_blocking_call *) * count);
-    callbacks = malloc(sizeof(callbacks[0]) * count);
-
-    for (i = 0; i < count; i++)
-    {
-        blocking_call[i].completed = 0;
-        blocking_calls[i] = &blocking_call[i];
-        callbacks[i] = castle_blocking_callback;
-    }
-
-    castle_request_send(conn, req, callbacks, blocking_calls, count);
-
-    pthread_mutex_lock(&blocking_call_mutex);
-    for (i = 0; i < count; i++)
-    {
-        while (conn->fd >= 0 && !blocking_call[i].completed)
-            pthread_cond_wait(&blocking_call_cond, &blocking_call_mutex);
-    }
-    pthread_mutex_unlock(&blocking_call_mutex);
 
-    free(blocking_calls);
-    free(callbacks);
+    castle_request_submit(conn, req, blocking_call, count);
 
     for (i = 0; i < count; i++)
-      if (conn->fd < 0 && !blocking_call[i].completed) {
-        blocking_call[i].completed = 1;
-        blocking_call[i].err = EUNATCH;
-      }
+        castle_request_wait(conn, &blocking_call[i]);
 
     for (i = 0; i < count; i++)
         if (blocking_call[i].err)
@@ -782,6 +956,13 @@ int castle_request_do_blocking_multi(castle_connection *conn,
     return 0;
 }
 
+void castle_iter_stats_get(castle_connection *conn, struct castle_iter_stats *stats)
+{
+    stats->round_trips = __sync_fetch_and_add(&conn->iter_round_trips, 0);
+    stats->entries     = __sync_fetch_and_add(&conn->iter_entries, 0);
+    stats->bytes       = __sync_fetch_and_add(&conn->iter_bytes, 0);
+}
+
 uint32_t
 castle_max_buffer_size(void) {
   return 1048576;
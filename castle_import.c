@@ -0,0 +1,651 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "castle.h"
+
+/*
+ * castle_import: bulk load unsorted records into a collection.
+ *
+ * Input is read from the files named on the command line, or stdin, one
+ * record per line:
+ *
+ *     key<TAB>value[<TAB>timestamp]
+ *     key
+ *
+ * where key is one or more dimensions separated by the dimension separator
+ * (',' by default).  A line with no value removes the key.
+ *
+ * Records are gathered into run buffers which are sorted and spilled to
+ * temporary files by worker threads while the next run is read, so memory
+ * use is bounded by -m however large the input.  The runs are then
+ * memory-mapped and merged, and the merged stream fed to the collection
+ * through castle_bulk_load_*.  Where a key appears more than once the last
+ * record read wins.
+ */
+
+#define IMPORT_DEFAULT_MEM_MB       256
+#define IMPORT_MAX_DIMS             64
+#define IMPORT_ALIGN                8
+#define IMPORT_PROGRESS_USEC        1000000
+
+/* A record, as laid out in run buffers and spill files. */
+struct import_rec
+{
+    uint32_t                key_len;
+    uint32_t                val_len;
+    castle_user_timestamp_t timestamp;
+    uint8_t                 type;           /**< CASTLE_STREAMING_ENTRY_HEADER_TYPE_*       */
+    uint8_t                 _unused[7];
+    /* Followed by the key, then the value, padded to IMPORT_ALIGN. */
+};
+
+#define import_rec_key(_rec)    ((castle_key *)((char *)(_rec) + sizeof(struct import_rec)))
+#define import_rec_val(_rec)    ((char *)import_rec_key(_rec) + (_rec)->key_len)
+#define import_rec_size(_rec)   import_align(sizeof(struct import_rec) + (_rec)->key_len + (_rec)->val_len)
+#define import_align(_len)      (((_len) + IMPORT_ALIGN - 1) & ~(uint64_t)(IMPORT_ALIGN - 1))
+
+/* A sorted run, spilled to an unlinked temporary file. */
+struct import_run
+{
+    int                     fd;
+    uint64_t                len;
+    char                   *map;
+    uint64_t                pos;            /**< Offset of the next record during merge     */
+};
+
+/* Buffer that records are read into and then sorted and spilled from. */
+struct import_buf
+{
+    char                   *arena;
+    uint64_t                size;
+    uint64_t                used;           /**< Arena bytes used                           */
+    struct import_rec     **index;
+    uint64_t                nr;
+    uint64_t                max_nr;
+
+    unsigned int            run;            /**< Run number this buffer will be spilled as  */
+    pthread_t               thread;
+    int                     busy;
+    struct import_ctx      *ctx;
+};
+
+struct import_ctx
+{
+    const char             *tmpdir;
+    char                    dim_sep;
+    int                     quiet;
+
+    struct import_buf      *bufs;
+    unsigned int            nr_bufs;
+    struct import_buf      *curr;
+
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    struct import_run      *runs;
+    unsigned int            nr_runs;
+    int                     err;
+
+    uint64_t                records;
+    uint64_t                bytes;
+    uint64_t                medium_pages;
+    struct timeval          start;
+    struct timeval          last_progress;
+};
+
+static double import_elapsed(struct import_ctx *ctx, struct timeval *now)
+{
+    return (now->tv_sec - ctx->start.tv_sec) + (now->tv_usec - ctx->start.tv_usec) / 1e6;
+}
+
+static void import_progress(struct import_ctx *ctx, const char *phase, uint64_t records,
+                            uint64_t bytes, int force)
+{
+    struct timeval now;
+    double secs;
+
+    if (ctx->quiet && !force)
+        return;
+
+    gettimeofday(&now, NULL);
+    if (!force && (uint64_t)((now.tv_sec - ctx->last_progress.tv_sec) * 1000000
+                             + (now.tv_usec - ctx->last_progress.tv_usec)) < IMPORT_PROGRESS_USEC)
+        return;
+    ctx->last_progress = now;
+
+    secs = import_elapsed(ctx, &now);
+    if (secs <= 0)
+        secs = 1e-6;
+    fprintf(stderr, "%s: %" PRIu64 " records, %.1f MB, %.1fs, %.0f records/s, %.1f MB/s\n",
+            phase, records, bytes / 1048576.0, secs, records / secs, bytes / 1048576.0 / secs);
+}
+
+/* Sort order for a run: by key, then by position so the last record read is last. */
+static int import_rec_cmp(const void *a, const void *b)
+{
+    const struct import_rec *rec_a = *(const struct import_rec * const *)a;
+    const struct import_rec *rec_b = *(const struct import_rec * const *)b;
+    int cmp = castle_key_compare(import_rec_key(rec_a), import_rec_key(rec_b));
+
+    if (cmp)
+        return cmp;
+
+    return (rec_a > rec_b) - (rec_a < rec_b);
+}
+
+static int import_write_full(int fd, const char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t ret = write(fd, buf, len);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+/* Sort a full buffer and write it out as a run.  Runs on a worker thread. */
+static void *import_spill(void *data)
+{
+    struct import_buf *buf = data;
+    struct import_ctx *ctx = buf->ctx;
+    uint64_t i, run_len = 0;
+    int fd = -1, err = 0;
+    char *tmpl;
+
+    qsort(buf->index, buf->nr, sizeof(*buf->index), import_rec_cmp);
+
+    if (asprintf(&tmpl, "%s/castle_import.XXXXXX", ctx->tmpdir) < 0)
+    {
+        err = -ENOMEM;
+        goto out;
+    }
+    fd = mkstemp(tmpl);
+    if (fd < 0)
+    {
+        err = -errno;
+        free(tmpl);
+        goto out;
+    }
+    unlink(tmpl);
+    free(tmpl);
+
+    /* Write the records out in sorted order, coalescing adjacent ones. */
+    for (i = 0; i < buf->nr && !err; )
+    {
+        char *from = (char *)buf->index[i];
+        uint64_t len = import_rec_size(buf->index[i]);
+
+        for (i++; i < buf->nr && (char *)buf->index[i] == from + len; i++)
+            len += import_rec_size(buf->index[i]);
+
+        err = import_write_full(fd, from, len);
+        run_len += len;
+    }
+
+    if (err)
+    {
+        close(fd);
+        fd = -1;
+    }
+
+out:
+    /* ctx->runs may be reallocated by the reader, so only touch it locked. */
+    pthread_mutex_lock(&ctx->lock);
+    ctx->runs[buf->run].fd = fd;
+    ctx->runs[buf->run].len = run_len;
+    if (err && !ctx->err)
+        ctx->err = err;
+    buf->busy = 0;
+    buf->used = 0;
+    buf->nr = 0;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    return NULL;
+}
+
+/* Hand the current buffer to a worker and switch to a free one. */
+static int import_flush(struct import_ctx *ctx)
+{
+    struct import_buf *buf = ctx->curr;
+    struct import_run *runs;
+    unsigned int i;
+
+    if (buf->nr == 0)
+        return ctx->err;
+
+    pthread_mutex_lock(&ctx->lock);
+    runs = realloc(ctx->runs, (ctx->nr_runs + 1) * sizeof(*runs));
+    if (!runs)
+    {
+        pthread_mutex_unlock(&ctx->lock);
+        return -ENOMEM;
+    }
+    ctx->runs = runs;
+    memset(&runs[ctx->nr_runs], 0, sizeof(*runs));
+    runs[ctx->nr_runs].fd = -1;
+    buf->run = ctx->nr_runs++;
+    buf->busy = 1;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (pthread_create(&buf->thread, NULL, import_spill, buf))
+    {
+        import_spill(buf);
+        return ctx->err;
+    }
+    pthread_detach(buf->thread);
+
+    /* Wait for a buffer to come free. */
+    pthread_mutex_lock(&ctx->lock);
+    for (;;)
+    {
+        for (i = 0; i < ctx->nr_bufs && ctx->bufs[i].busy; i++);
+        if (i < ctx->nr_bufs || ctx->err)
+            break;
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (i < ctx->nr_bufs)
+        ctx->curr = &ctx->bufs[i];
+
+    return ctx->err;
+}
+
+static void import_wait_spills(struct import_ctx *ctx)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (i = 0; i < ctx->nr_bufs; )
+    {
+        if (ctx->bufs[i].busy)
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        else
+            i++;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Parse a line and add it to the current buffer. */
+static int import_add_line(struct import_ctx *ctx, char *line, size_t len, uint64_t lineno)
+{
+    const uint8_t *elems[IMPORT_MAX_DIMS];
+    int lens[IMPORT_MAX_DIMS];
+    struct import_buf *buf;
+    struct import_rec *rec;
+    char *key, *val = NULL, *ts = NULL, *p;
+    uint32_t key_len, val_len = 0;
+    uint64_t need;
+    int dims = 0, err;
+
+    if (len && line[len - 1] == '\n')
+        line[--len] = '\0';
+    if (len == 0)
+        return 0;
+
+    key = line;
+    if ((p = strchr(line, '\t')))
+    {
+        *p = '\0';
+        val = p + 1;
+        if ((p = strchr(val, '\t')))
+        {
+            *p = '\0';
+            ts = p + 1;
+        }
+        val_len = strlen(val);
+    }
+
+    for (p = key; ; p++)
+    {
+        if (*p == ctx->dim_sep || *p == '\0')
+        {
+            if (dims == IMPORT_MAX_DIMS)
+            {
+                fprintf(stderr, "Line %" PRIu64 ": more than %d key dimensions.\n", lineno, IMPORT_MAX_DIMS);
+                return -EINVAL;
+            }
+            elems[dims] = (const uint8_t *)key;
+            lens[dims++] = p - key;
+            if (*p == '\0')
+                break;
+            key = p + 1;
+        }
+    }
+
+    key_len = castle_key_bytes_needed(dims, lens, elems, NULL);
+    need = import_align(sizeof(*rec) + key_len + val_len);
+    if (need + sizeof(*buf->index) > ctx->curr->size)
+    {
+        fprintf(stderr, "Line %" PRIu64 ": record too large for the memory limit.\n", lineno);
+        return -EFBIG;
+    }
+
+    /* The index counts against the buffer too. */
+    if (ctx->curr->used + need + (ctx->curr->nr + 1) * sizeof(*buf->index) > ctx->curr->size)
+    {
+        err = import_flush(ctx);
+        if (err)
+            return err;
+    }
+    buf = ctx->curr;
+
+    if (buf->nr == buf->max_nr)
+    {
+        uint64_t new_max = buf->max_nr ? buf->max_nr * 2 : 1024;
+        struct import_rec **index = realloc(buf->index, new_max * sizeof(*index));
+        if (!index)
+            return -ENOMEM;
+        buf->index = index;
+        buf->max_nr = new_max;
+    }
+
+    rec = (struct import_rec *)(buf->arena + buf->used);
+    memset(rec, 0, sizeof(*rec));
+    rec->key_len = key_len;
+    rec->val_len = val_len;
+    rec->timestamp = ts ? strtoull(ts, NULL, 0) : 0;
+    rec->type = val ? CASTLE_STREAMING_ENTRY_HEADER_TYPE_VALUE
+                    : CASTLE_STREAMING_ENTRY_HEADER_TYPE_TOMBSTONE;
+    if (castle_build_key(import_rec_key(rec), key_len, dims, lens, elems, NULL))
+        abort();
+    memcpy(import_rec_val(rec), val, val_len);
+
+    buf->index[buf->nr++] = rec;
+    buf->used += need;
+
+    ctx->records++;
+    ctx->bytes += len;
+    ctx->medium_pages += castle_bulk_load_value_pages(val_len);
+
+    return 0;
+}
+
+static int import_read(struct import_ctx *ctx, FILE *f)
+{
+    char *line = NULL;
+    size_t line_size = 0;
+    uint64_t lineno = 0;
+    ssize_t len;
+    int err = 0;
+
+    while (!err && (len = getline(&line, &line_size, f)) >= 0)
+    {
+        err = import_add_line(ctx, line, len, ++lineno);
+        import_progress(ctx, "read", ctx->records, ctx->bytes, 0);
+    }
+    if (!err && ferror(f))
+        err = -EIO;
+
+    free(line);
+
+    return err;
+}
+
+/* Min-heap of runs, ordered by their next record, then by run number. */
+static int import_heap_less(struct import_ctx *ctx, unsigned int a, unsigned int b)
+{
+    struct import_rec *rec_a = (struct import_rec *)(ctx->runs[a].map + ctx->runs[a].pos);
+    struct import_rec *rec_b = (struct import_rec *)(ctx->runs[b].map + ctx->runs[b].pos);
+    int cmp = castle_key_compare(import_rec_key(rec_a), import_rec_key(rec_b));
+
+    return cmp ? cmp < 0 : a < b;
+}
+
+static void import_heap_down(struct import_ctx *ctx, unsigned int *heap, unsigned int n, unsigned int i)
+{
+    for (;;)
+    {
+        unsigned int l = 2 * i + 1, r = l + 1, min = i, tmp;
+
+        if (l < n && import_heap_less(ctx, heap[l], heap[min]))
+            min = l;
+        if (r < n && import_heap_less(ctx, heap[r], heap[min]))
+            min = r;
+        if (min == i)
+            return;
+
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/* Take the next record from the run at the top of the heap. */
+static struct import_rec *import_heap_pop(struct import_ctx *ctx, unsigned int *heap, unsigned int *n)
+{
+    struct import_run *run = &ctx->runs[heap[0]];
+    struct import_rec *rec = (struct import_rec *)(run->map + run->pos);
+
+    run->pos += import_rec_size(rec);
+    if (run->pos >= run->len)
+        heap[0] = heap[--(*n)];
+    if (*n)
+        import_heap_down(ctx, heap, *n, 0);
+
+    return rec;
+}
+
+static int import_merge_load(struct import_ctx *ctx, castle_connection *conn, castle_collection coll)
+{
+    castle_bulk_loader *loader;
+    unsigned int *heap, n = 0, i;
+    uint64_t loaded = 0, loaded_bytes = 0;
+    int err, ret;
+
+    heap = calloc(ctx->nr_runs + 1, sizeof(*heap));
+    if (!heap)
+        return -ENOMEM;
+
+    for (i = 0; i < ctx->nr_runs; i++)
+    {
+        struct import_run *run = &ctx->runs[i];
+
+        if (run->len == 0)
+            continue;
+        run->map = mmap(NULL, run->len, PROT_READ, MAP_PRIVATE, run->fd, 0);
+        if (run->map == MAP_FAILED)
+        {
+            run->map = NULL;
+            err = -errno;
+            goto out;
+        }
+        madvise(run->map, run->len, MADV_SEQUENTIAL);
+        heap[n++] = i;
+    }
+    for (i = n / 2; i-- > 0; )
+        import_heap_down(ctx, heap, n, i);
+
+    /* Duplicates are dropped in the merge, so these are upper bounds. */
+    err = castle_bulk_load_start(conn, coll, ctx->records,
+                                 castle_bulk_load_chunks(ctx->medium_pages), &loader);
+    if (err)
+        goto out;
+
+    gettimeofday(&ctx->start, NULL);
+    while (n && !err)
+    {
+        struct import_rec *rec = import_heap_pop(ctx, heap, &n);
+
+        /* Of a run of equal keys, keep the last record read. */
+        while (n)
+        {
+            struct import_run *top = &ctx->runs[heap[0]];
+            struct import_rec *next = (struct import_rec *)(top->map + top->pos);
+
+            if (castle_key_compare(import_rec_key(rec), import_rec_key(next)))
+                break;
+            rec = import_heap_pop(ctx, heap, &n);
+        }
+
+        err = castle_bulk_load_add(loader, import_rec_key(rec), import_rec_val(rec),
+                                   rec->val_len, rec->timestamp, rec->type);
+        loaded++;
+        loaded_bytes += rec->key_len + rec->val_len;
+        import_progress(ctx, "load", loaded, loaded_bytes, 0);
+    }
+
+    ret = castle_bulk_load_finish(loader, err != 0);
+    if (!err)
+        err = ret;
+    if (!err)
+        import_progress(ctx, "loaded", loaded, loaded_bytes, 1);
+
+out:
+    for (i = 0; i < ctx->nr_runs; i++)
+        if (ctx->runs[i].map)
+            munmap(ctx->runs[i].map, ctx->runs[i].len);
+    free(heap);
+
+    return err;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-c collection_id | -n collection_name] [-m memory_mb] [-j threads]\n"
+            "          [-T tmpdir] [-d dim_separator] [-q] [file ...]\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct import_ctx ctx;
+    castle_connection *conn;
+    castle_collection coll = 0;
+    const char *coll_name = NULL;
+    uint64_t mem_mb = IMPORT_DEFAULT_MEM_MB;
+    unsigned int i, threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int have_coll = 0, opt, err = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    ctx.dim_sep = ',';
+
+    while ((opt = getopt(argc, argv, "c:n:m:j:T:d:q")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c': coll = strtoul(optarg, NULL, 0); have_coll = 1; break;
+            case 'n': coll_name = optarg; break;
+            case 'm': mem_mb = strtoull(optarg, NULL, 0); break;
+            case 'j': threads = strtoul(optarg, NULL, 0); break;
+            case 'T': ctx.tmpdir = optarg; break;
+            case 'd': ctx.dim_sep = optarg[0]; break;
+            case 'q': ctx.quiet = 1; break;
+            default:
+                usage(argv[0]);
+                return -EINVAL;
+        }
+    }
+
+    if (coll_name)
+    {
+        if ((err = castle_collection_find(coll_name, &coll)))
+        {
+            fprintf(stderr, "Collection %s not found (%d).\n", coll_name, err);
+            return err;
+        }
+        have_coll = 1;
+    }
+    if (!have_coll || mem_mb == 0)
+    {
+        usage(argv[0]);
+        return -EINVAL;
+    }
+    if (threads < 1)
+        threads = 1;
+
+    /* One buffer being read into while the others are sorted and spilled. */
+    ctx.nr_bufs = threads + 1;
+    ctx.bufs = calloc(ctx.nr_bufs, sizeof(*ctx.bufs));
+    if (!ctx.bufs)
+        return -ENOMEM;
+    for (i = 0; i < ctx.nr_bufs; i++)
+    {
+        ctx.bufs[i].ctx = &ctx;
+        ctx.bufs[i].size = (mem_mb << 20) / ctx.nr_bufs;
+        ctx.bufs[i].arena = malloc(ctx.bufs[i].size);
+        if (!ctx.bufs[i].arena)
+        {
+            fprintf(stderr, "Failed to allocate %" PRIu64 " MB of run buffers.\n", mem_mb);
+            err = -ENOMEM;
+            goto out0;
+        }
+    }
+    ctx.curr = &ctx.bufs[0];
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+
+    if ((err = castle_connect(&conn)))
+    {
+        fprintf(stderr, "castle_connect failed with error code %d (is Castle running?)\n", err);
+        goto out1;
+    }
+
+    gettimeofday(&ctx.start, NULL);
+    if (optind == argc)
+        err = import_read(&ctx, stdin);
+    for (i = optind; i < (unsigned int)argc && !err; i++)
+    {
+        FILE *f = fopen(argv[i], "r");
+        if (!f)
+        {
+            err = -errno;
+            fprintf(stderr, "Failed to open %s: %s\n", argv[i], strerror(errno));
+            break;
+        }
+        err = import_read(&ctx, f);
+        fclose(f);
+    }
+    if (!err)
+        err = import_flush(&ctx);
+    import_wait_spills(&ctx);
+    if (!err)
+        err = ctx.err;
+    if (!err)
+        import_progress(&ctx, "sorted", ctx.records, ctx.bytes, !ctx.quiet);
+
+    if (!err)
+        err = import_merge_load(&ctx, conn, coll);
+    if (err)
+        fprintf(stderr, "Import failed with error code %d.\n", err);
+
+    castle_free(conn);
+out1:
+    for (i = 0; i < ctx.nr_runs; i++)
+        if (ctx.runs[i].fd >= 0)
+            close(ctx.runs[i].fd);
+    free(ctx.runs);
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.lock);
+out0:
+    for (i = 0; i < ctx.nr_bufs; i++)
+    {
+        free(ctx.bufs[i].arena);
+        free(ctx.bufs[i].index);
+    }
+    free(ctx.bufs);
+
+    return err;
+}
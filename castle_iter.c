@@ -0,0 +1,720 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "castle.h"
+#include "castle_private.h"
+
+/*
+ * Iterator cursors.
+ *
+ * Unlike castle_iter_start()/castle_iter_next(), which copy every key and
+ * value out of the iterator buffer into a freshly allocated list, a cursor
+ * hands out pointers to the castle_key_value_list entries where the kernel
+ * wrote them, in shared buffers owned by the cursor.  An entry stays valid
+ * until the cursor is advanced past the end of its batch, at which point the
+ * buffer is reused for a later ITER_NEXT.
+ *
+ * With a prefetch depth of N the cursor cycles through N buffers.  As soon as
+ * a batch arrives saying the iterator has more, the next ITER_NEXT is sent
+ * into a free buffer - from the completion callback if possible - so the
+ * kernel fills up to N-1 batches ahead of the consumer.  Only one ITER_NEXT is
+ * ever outstanding, because whether there is another batch to ask for is only
+ * known once the previous one has arrived.
+ */
+
+#define CASTLE_CURSOR_MAX_DEPTH 8
+
+enum {
+    CURSOR_BUF_FREE = 0,
+    CURSOR_BUF_IN_FLIGHT,
+    CURSOR_BUF_READY,
+};
+
+struct castle_cursor_buffer
+{
+    char     *buf;
+    uint32_t  size;
+    int       state;                        /**< CURSOR_BUF_*                               */
+    int       err;                          /**< Result of the request that filled it       */
+};
+
+struct castle_cursor
+{
+    castle_connection            *conn;
+    castle_token                  token;
+    uint8_t                       flags;
+    c_collection_id_t             collection;
+    castle_key                   *end_key;      /**< Copy, for restarting after a seek     */
+    struct castle_blocking_call   start_call;   /**< ITER_START, until start_wait         */
+    char                         *key_buf;      /**< Keys for ITER_START, until start_wait */
+    uint32_t                      key_buf_len;
+    struct castle_iter_filter    *filter;       /**< Entries to return, NULL => all        */
+
+    pthread_mutex_t               lock;
+    pthread_cond_t                cond;
+    struct castle_cursor_buffer   bufs[CASTLE_CURSOR_MAX_DEPTH];
+    unsigned int                  depth;
+    unsigned int                  cons;     /**< Buffer being read by the consumer          */
+    unsigned int                  prod;     /**< Buffer the next ITER_NEXT will fill        */
+    unsigned int                  flight;   /**< Buffer the outstanding ITER_NEXT fills     */
+    int                           loaded;   /**< bufs[cons] has been handed to the consumer */
+    int                           more;     /**< Iterator has batches not yet requested     */
+    int                           in_flight;
+    int                           ended;    /**< Kernel has completed the iterator          */
+    int                           closing;
+    int                           err;
+    uint32_t                      grow_size;    /**< Size for buffers handed back next  */
+    uint32_t                      grow_max;     /**< Largest grow_size, 0 => fixed size */
+
+    struct castle_key_value_list *curr;     /**< Next entry to return, NULL at end of batch */
+};
+
+/*
+ * Count the batch in buf in the connection's iterator stats, as
+ * castle_iter_process_kvs() does, and say whether it ends by linking back to
+ * the start (more to come).
+ */
+static int castle_cursor_batch_account(castle_connection *conn, char *buf)
+{
+    struct castle_key_value_list *kv = (struct castle_key_value_list *)buf;
+    uint64_t entries = 0, bytes = 0;
+    int more = 0;
+
+    if (kv->key != NULL)
+    {
+        for (;;)
+        {
+            entries++;
+            bytes += castle_key_length(kv->key)
+                + (VALUE_INLINE(kv->val->type) ? kv->val->length : 0);
+            if (!kv->next || kv->next <= kv)
+                break;
+            kv = kv->next;
+        }
+        more = kv->next != NULL;
+    }
+
+    __sync_fetch_and_add(&conn->iter_round_trips, 1);
+    __sync_fetch_and_add(&conn->iter_entries, entries);
+    __sync_fetch_and_add(&conn->iter_bytes, bytes);
+
+    return more;
+}
+
+/* Record the arrival of a batch.  Called with the cursor lock held. */
+static void castle_cursor_batch_done_locked(castle_cursor *cursor, struct castle_cursor_buffer *b)
+{
+    b->state = CURSOR_BUF_READY;
+
+    if (b->err)
+    {
+        /* Nothing more can be asked of the iterator; leave it for finish to tidy up. */
+        cursor->more = 0;
+        return;
+    }
+
+    cursor->more = castle_cursor_batch_account(cursor->conn, b->buf);
+    cursor->ended = !cursor->more;
+
+    /* The batch filled its buffer, so double the buffers as they come free,
+     * as castle_getslice() does. */
+    if (cursor->more && cursor->grow_size < cursor->grow_max)
+        cursor->grow_size = cursor->grow_size << 1 < cursor->grow_max
+            ? cursor->grow_size << 1 : cursor->grow_max;
+}
+
+/*
+ * Claim the next buffer for an ITER_NEXT, if one is wanted and free.
+ * Called with the cursor lock held; the request must be sent after dropping it.
+ *
+ * @return  Buffer index, or -1 if nothing should be sent
+ */
+static int castle_cursor_claim_locked(castle_cursor *cursor)
+{
+    unsigned int idx = cursor->prod;
+
+    if (!cursor->more || cursor->in_flight || cursor->closing
+            || cursor->bufs[idx].state != CURSOR_BUF_FREE)
+        return -1;
+
+    cursor->bufs[idx].state = CURSOR_BUF_IN_FLIGHT;
+    cursor->in_flight = 1;
+    cursor->more = 0;
+    cursor->flight = idx;
+    cursor->prod = (idx + 1) % cursor->depth;
+
+    return idx;
+}
+
+static void castle_cursor_callback(castle_connection *conn, castle_response_t *resp, void *data);
+
+/* Send ITER_NEXT into a buffer claimed by castle_cursor_claim_locked(). */
+static void castle_cursor_issue(castle_cursor *cursor, unsigned int idx, int from_callback)
+{
+    struct castle_cursor_buffer *b = &cursor->bufs[idx];
+    castle_callback callback = castle_cursor_callback;
+    void *data = cursor;
+    castle_request_t req;
+    int err = 0;
+
+    castle_iter_next_prepare(&req, cursor->token, b->buf, b->size, cursor->flags);
+
+    if (from_callback)
+        err = castle_request_send_nowait(cursor->conn, &req, callback, data);
+    else if (cursor->conn->fd < 0)
+        err = -EUNATCH;
+    else
+        castle_request_send(cursor->conn, &req, &callback, &data, 1);
+
+    if (!err)
+        return;
+
+    pthread_mutex_lock(&cursor->lock);
+    cursor->in_flight = 0;
+    if (err == -EAGAIN)
+    {
+        /* Ring is full; hand the request back for the consumer to send. */
+        b->state = CURSOR_BUF_FREE;
+        cursor->prod = idx;
+        cursor->more = 1;
+    }
+    else
+    {
+        b->err = err;
+        castle_cursor_batch_done_locked(cursor, b);
+    }
+    pthread_cond_broadcast(&cursor->cond);
+    pthread_mutex_unlock(&cursor->lock);
+}
+
+static void castle_cursor_callback(castle_connection *conn __attribute__((unused)),
+                                   castle_response_t *resp, void *data)
+{
+    castle_cursor *cursor = data;
+    int chain;
+
+    pthread_mutex_lock(&cursor->lock);
+    cursor->in_flight = 0;
+    cursor->bufs[cursor->flight].err = resp->err;
+    castle_cursor_batch_done_locked(cursor, &cursor->bufs[cursor->flight]);
+    chain = castle_cursor_claim_locked(cursor);
+    pthread_cond_broadcast(&cursor->cond);
+    pthread_mutex_unlock(&cursor->lock);
+
+    if (chain >= 0)
+        castle_cursor_issue(cursor, chain, 1);
+}
+
+static void castle_cursor_free(castle_cursor *cursor)
+{
+    for (unsigned int i = 0; i < cursor->depth; i++)
+        castle_shared_buffer_put(cursor->conn, cursor->bufs[i].buf, cursor->bufs[i].size);
+
+    pthread_cond_destroy(&cursor->cond);
+    pthread_mutex_destroy(&cursor->lock);
+    free(cursor->end_key);
+    free(cursor);
+}
+
+/*
+ * Send the ITER_START for a new cursor without waiting for it, so that
+ * several iterators can be started in one round trip.  The cursor may only be
+ * passed to castle_cursor_start_wait().
+ */
+int castle_cursor_start_submit(castle_connection *conn,
+                               c_collection_id_t collection,
+                               castle_key *start_key,
+                               castle_key *end_key,
+                               uint32_t buf_size,
+                               uint8_t flags,
+                               castle_cursor **cursor_out)
+{
+    castle_request_t req;
+    castle_cursor *cursor;
+    uint32_t start_key_len, end_key_len;
+    int err = 0;
+
+    *cursor_out = NULL;
+
+    cursor = calloc(1, sizeof(*cursor));
+    if (!cursor)
+    {
+        err = -ENOMEM;
+        goto err0;
+    }
+    cursor->conn = conn;
+    cursor->flags = flags;
+    cursor->depth = 1;
+    cursor->collection = collection;
+    pthread_mutex_init(&cursor->lock, NULL);
+    pthread_cond_init(&cursor->cond, NULL);
+
+    end_key_len = castle_key_buffer_len(end_key);
+    cursor->end_key = malloc(end_key_len);
+    if (!cursor->end_key)
+    {
+        err = -ENOMEM;
+        goto err1;
+    }
+    castle_key_buffer_fill(end_key, (char *)cursor->end_key, end_key_len);
+
+    err = castle_make_2key_buffer(conn, start_key, end_key, &cursor->key_buf,
+                                  &start_key_len, &end_key_len);
+    if (err)
+        goto err1;
+    cursor->key_buf_len = start_key_len + end_key_len;
+
+    cursor->bufs[0].size = buf_size;
+    cursor->grow_size = buf_size;
+    err = castle_shared_buffer_get(conn, buf_size, &cursor->bufs[0].buf);
+    if (err)
+        goto err2;
+
+    castle_iter_start_prepare(&req,
+                              collection,
+                              (castle_key *) cursor->key_buf,
+                              start_key_len,
+                              (castle_key *) (cursor->key_buf + start_key_len),
+                              end_key_len,
+                              cursor->bufs[0].buf,
+                              buf_size,
+                              flags);
+
+    castle_request_submit(conn, &req, &cursor->start_call, 1);
+
+    *cursor_out = cursor;
+
+    return 0;
+
+err2:
+    castle_shared_buffer_destroy(conn, cursor->key_buf, cursor->key_buf_len);
+err1:
+    free(cursor->end_key);
+    pthread_cond_destroy(&cursor->cond);
+    pthread_mutex_destroy(&cursor->lock);
+    free(cursor);
+err0:
+    return err;
+}
+
+/*
+ * Wait for the ITER_START sent by castle_cursor_start_submit().  On failure
+ * the cursor is freed.
+ */
+int castle_cursor_start_wait(castle_cursor *cursor)
+{
+    castle_connection *conn = cursor->conn;
+    int err;
+
+    err = castle_request_wait(conn, &cursor->start_call);
+
+    castle_shared_buffer_destroy(conn, cursor->key_buf, cursor->key_buf_len);
+    cursor->key_buf = NULL;
+
+    if (err)
+    {
+        castle_cursor_free(cursor);
+        return err;
+    }
+
+    cursor->token = cursor->start_call.token;
+    castle_cursor_batch_done_locked(cursor, &cursor->bufs[0]);
+
+    return 0;
+}
+
+/**
+ * Start an iterator over [start_key, end_key] and return a cursor on it.
+ *
+ * The cursor starts with a single buffer, so each batch is only requested
+ * once the previous one has been consumed; see castle_cursor_prefetch().
+ *
+ * @param   buf_size    Size of the shared buffers batches are returned in
+ * @param   flags       CASTLE_RING_FLAG_* passed on ITER_START and ITER_NEXT,
+ *                      e.g. CASTLE_RING_FLAG_ITER_NO_VALUES
+ */
+int castle_cursor_start(castle_connection *conn,
+                        c_collection_id_t collection,
+                        castle_key *start_key,
+                        castle_key *end_key,
+                        uint32_t buf_size,
+                        uint8_t flags,
+                        castle_cursor **cursor_out)
+{
+    castle_cursor *cursor;
+    int err;
+
+    *cursor_out = NULL;
+
+    err = castle_cursor_start_submit(conn, collection, start_key, end_key, buf_size, flags, &cursor);
+    if (err)
+        return err;
+
+    err = castle_cursor_start_wait(cursor);
+    if (err)
+        return err;
+
+    *cursor_out = cursor;
+
+    return 0;
+}
+
+/**
+ * Let the kernel fill up to depth - 1 batches ahead of the consumer.
+ *
+ * Allocates the extra buffers and, if the iterator has more to return, asks
+ * for the next batch straight away.  May only be called once, on a cursor
+ * that has not yet been given a depth.
+ *
+ * @param   depth   Number of buffers, at most CASTLE_CURSOR_MAX_DEPTH
+ */
+int castle_cursor_prefetch(castle_cursor *cursor, unsigned int depth)
+{
+    int issue;
+
+    if (depth < 1 || depth > CASTLE_CURSOR_MAX_DEPTH || cursor->depth != 1)
+        return -EINVAL;
+
+    /* Nothing is in flight on a depth-one cursor between calls, so the new
+     * buffers can be set up before taking the lock. */
+    for (unsigned int i = 1; i < depth; i++)
+    {
+        cursor->bufs[i].size = cursor->bufs[0].size;
+        int err = castle_shared_buffer_get(cursor->conn, cursor->bufs[i].size, &cursor->bufs[i].buf);
+        if (err)
+        {
+            while (--i > 0)
+                castle_shared_buffer_put(cursor->conn, cursor->bufs[i].buf, cursor->bufs[i].size);
+            return err;
+        }
+    }
+
+    pthread_mutex_lock(&cursor->lock);
+    cursor->depth = depth;
+    cursor->prod = (cursor->cons + 1) % depth;
+    issue = castle_cursor_claim_locked(cursor);
+    pthread_mutex_unlock(&cursor->lock);
+
+    if (issue >= 0)
+        castle_cursor_issue(cursor, issue, 0);
+
+    return 0;
+}
+
+/**
+ * Let the cursor's buffers grow: each batch that arrives with more to come
+ * doubles the size buffers are given as the consumer hands them back, up to
+ * max_size.  Growth is best effort; a buffer that can't be replaced is kept.
+ *
+ * @param   max_size    Largest buffer size, at most castle_max_buffer_size()
+ */
+int castle_cursor_grow(castle_cursor *cursor, uint32_t max_size)
+{
+    if (max_size > castle_max_buffer_size())
+        return -EINVAL;
+
+    pthread_mutex_lock(&cursor->lock);
+    cursor->grow_max = max_size;
+    pthread_mutex_unlock(&cursor->lock);
+
+    return 0;
+}
+
+/*
+ * Hand the consumed batch back, first replacing its buffer with a larger one
+ * if the cursor is growing.  Only the consumer touches a loaded buffer, so the
+ * replacement happens outside the lock.
+ */
+static void castle_cursor_release(castle_cursor *cursor)
+{
+    struct castle_cursor_buffer *b = &cursor->bufs[cursor->cons];
+    uint32_t size;
+    char *buf;
+
+    if (!cursor->loaded)
+        return;
+
+    pthread_mutex_lock(&cursor->lock);
+    size = cursor->grow_size;
+    pthread_mutex_unlock(&cursor->lock);
+
+    if (b->size < size && !castle_shared_buffer_get(cursor->conn, size, &buf))
+    {
+        castle_shared_buffer_put(cursor->conn, b->buf, b->size);
+        b->buf = buf;
+        b->size = size;
+    }
+
+    pthread_mutex_lock(&cursor->lock);
+    b->state = CURSOR_BUF_FREE;
+    cursor->cons = (cursor->cons + 1) % cursor->depth;
+    cursor->loaded = 0;
+    pthread_mutex_unlock(&cursor->lock);
+}
+
+/*
+ * Move the consumer on to the next batch, waiting for it to arrive.
+ *
+ * @return  1 if a batch is loaded, 0 at the end of the iterator, <0 on error
+ */
+static int castle_cursor_batch_next(castle_cursor *cursor)
+{
+    struct castle_cursor_buffer *b;
+    int issue, err;
+
+    castle_cursor_release(cursor);
+
+    pthread_mutex_lock(&cursor->lock);
+
+    while ((b = &cursor->bufs[cursor->cons])->state != CURSOR_BUF_READY)
+    {
+        if (b->state == CURSOR_BUF_FREE && !cursor->more && !cursor->in_flight)
+        {
+            pthread_mutex_unlock(&cursor->lock);
+            return 0;
+        }
+
+        issue = castle_cursor_claim_locked(cursor);
+        if (issue >= 0)
+        {
+            pthread_mutex_unlock(&cursor->lock);
+            castle_cursor_issue(cursor, issue, 0);
+            pthread_mutex_lock(&cursor->lock);
+            continue;
+        }
+
+        pthread_cond_wait(&cursor->cond, &cursor->lock);
+    }
+
+    cursor->loaded = 1;
+    err = b->err;
+
+    /* Keep the kernel busy while this batch is consumed. */
+    issue = castle_cursor_claim_locked(cursor);
+
+    pthread_mutex_unlock(&cursor->lock);
+
+    if (issue >= 0)
+        castle_cursor_issue(cursor, issue, 0);
+
+    if (err)
+        return err;
+
+    cursor->curr = (struct castle_key_value_list *)b->buf;
+    if (cursor->curr->key == NULL)
+        cursor->curr = NULL;
+
+    return 1;
+}
+
+/* Step past the entry at cursor->curr. */
+static void castle_cursor_advance(castle_cursor *cursor)
+{
+    struct castle_key_value_list *kv = cursor->curr;
+
+    /* The last entry in a batch links back to the start of the buffer if the
+     * iterator has more to return, or is NULL if it has completed. */
+    if (kv->next == NULL || kv->next < kv)
+        cursor->curr = NULL;
+    else
+        cursor->curr = kv->next;
+}
+
+/**
+ * Return the next entry from the iterator.
+ *
+ * The entry, its key and its value point into one of the cursor's shared
+ * buffers and are only valid until the next call.  Out-of-line values are
+ * returned as they are, with type CASTLE_VALUE_TYPE_OUT_OF_LINE; use
+ * castle_get() on the key to read them.
+ *
+ * @param   [out]   kv_out  Entry view, valid until the next call
+ *
+ * @return  1       An entry was returned
+ * @return  0       The iterator has completed
+ * @return  <0      Failure
+ */
+int castle_cursor_next(castle_cursor *cursor, struct castle_key_value_list **kv_out)
+{
+    struct castle_iter_filter *filter = cursor->filter;
+    struct castle_key_value_list *kv;
+
+    if (cursor->err)
+        return cursor->err;
+
+    do {
+        while (!cursor->curr)
+        {
+            int ret = castle_cursor_batch_next(cursor);
+            if (ret < 0)
+                cursor->err = ret;
+            if (ret <= 0)
+                return ret;
+        }
+
+        kv = cursor->curr;
+        castle_cursor_advance(cursor);
+
+        if (filter)
+            filter->scanned++;
+    } while (filter && !filter->fn(kv->key, kv->val, kv->user_timestamp, filter->userdata));
+
+    if (filter)
+        filter->emitted++;
+
+    *kv_out = kv;
+
+    return 1;
+}
+
+/**
+ * Have castle_cursor_next() return only the entries filter->fn accepts.  The
+ * predicate sees each entry in place in the cursor's buffer, before it is
+ * returned; rejected entries are stepped over.  filter's counters are updated
+ * as entries are tested, and it must stay valid while set.
+ *
+ * @param   filter  NULL => return every entry again
+ */
+void castle_cursor_set_filter(castle_cursor *cursor, struct castle_iter_filter *filter)
+{
+    cursor->filter = filter;
+}
+
+/*
+ * Move the kernel's iterator on to key, once everything it has returned has
+ * been consumed and nothing is in flight: finish it and start a new one from
+ * key to the cursor's end key, into the cursor's next buffer.
+ *
+ * The ring has no request to move a running iterator; CASTLE_RING_ITER_SKIP
+ * is reserved, but no kernel header defines its body.
+ */
+static int castle_cursor_restart(castle_cursor *cursor, castle_key *key)
+{
+    struct castle_blocking_call call;
+    struct castle_cursor_buffer *b;
+    castle_request_t req;
+    char *key_buf;
+    uint32_t key_len, end_key_len;
+    int err;
+
+    castle_cursor_release(cursor);
+
+    key_len = castle_key_buffer_len(key);
+    end_key_len = castle_key_length(cursor->end_key);
+    err = castle_shared_buffer_create(cursor->conn, &key_buf, key_len + end_key_len);
+    if (err)
+        return err;
+    castle_key_buffer_fill(key, key_buf, key_len);
+    memcpy(key_buf + key_len, cursor->end_key, end_key_len);
+
+    if (!cursor->ended)
+        castle_iter_finish(cursor->conn, cursor->token);
+
+    b = &cursor->bufs[cursor->cons];
+    castle_iter_start_prepare(&req, cursor->collection,
+                              (castle_key *)key_buf, key_len,
+                              (castle_key *)(key_buf + key_len), end_key_len,
+                              b->buf, b->size, cursor->flags);
+    err = castle_request_do_blocking(cursor->conn, &req, &call);
+
+    pthread_mutex_lock(&cursor->lock);
+    /* The old iterator is gone whether or not the new one started. */
+    cursor->ended = 1;
+    cursor->more = 0;
+    if (!err)
+    {
+        cursor->token = call.token;
+        b->err = 0;
+        castle_cursor_batch_done_locked(cursor, b);
+        cursor->prod = (cursor->cons + 1) % cursor->depth;
+    }
+    pthread_mutex_unlock(&cursor->lock);
+
+    castle_shared_buffer_destroy(cursor->conn, key_buf, key_len + end_key_len);
+
+    return err;
+}
+
+/**
+ * Move the cursor on so that the next entry returned is the first at or after
+ * key.  key must not be before the last entry returned.
+ *
+ * Entries already fetched are skipped in place.  Once they run out, the
+ * iterator is restarted from key into the cursor's buffers, rather than
+ * reading the batches in between.
+ */
+int castle_cursor_seek(castle_cursor *cursor, castle_key *key)
+{
+    unsigned int next;
+    int local, err;
+
+    if (cursor->err)
+        return cursor->err;
+
+    for (;;)
+    {
+        while (cursor->curr)
+        {
+            if (castle_key_compare(cursor->curr->key, key) >= 0)
+                return 0;
+            castle_cursor_advance(cursor);
+        }
+
+        /* Is there a batch fetched or on its way? */
+        pthread_mutex_lock(&cursor->lock);
+        next = cursor->loaded ? (cursor->cons + 1) % cursor->depth : cursor->cons;
+        local = cursor->in_flight
+                || (!(cursor->loaded && next == cursor->cons)
+                    && cursor->bufs[next].state != CURSOR_BUF_FREE);
+        if (!local && !cursor->more)
+        {
+            /* At the end of the iterator. */
+            pthread_mutex_unlock(&cursor->lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&cursor->lock);
+
+        if (!local && (err = castle_cursor_restart(cursor, key)))
+        {
+            cursor->err = err;
+            return err;
+        }
+
+        /* Load the batch, after a restart the new iterator's first. */
+        err = castle_cursor_batch_next(cursor);
+        if (err < 0)
+            cursor->err = err;
+        if (err <= 0)
+            return err;
+    }
+}
+
+/**
+ * Release a cursor, terminating the iterator if it has not completed.
+ */
+int castle_cursor_finish(castle_cursor *cursor)
+{
+    int err = 0;
+
+    if (!cursor)
+        return 0;
+
+    /* The kernel may still be writing into a prefetch buffer. */
+    pthread_mutex_lock(&cursor->lock);
+    cursor->closing = 1;
+    while (cursor->in_flight)
+        pthread_cond_wait(&cursor->cond, &cursor->lock);
+    pthread_mutex_unlock(&cursor->lock);
+
+    if (!cursor->ended)
+        err = castle_iter_finish(cursor->conn, cursor->token);
+
+    castle_cursor_free(cursor);
+
+    return err;
+}
@@ -0,0 +1,449 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+
+#include "castle.h"
+#include "castle_private.h"
+
+/*
+ * Key builder.
+ *
+ * castle_build_key() needs every dimension up front, and walks them twice:
+ * once to size the key and once to copy it in.  A key builder instead writes
+ * each dimension straight into its buffer as it is appended.  The number of
+ * dimensions is fixed when the builder is reset, which puts the payload
+ * immediately after the dim_head array and lets each dim_head be filled in as
+ * its dimension arrives.
+ *
+ * The buffer is one of
+ *  - supplied by the caller, in which case it never grows and an append which
+ *    doesn't fit fails with -ENOSPC;
+ *  - malloc()ed, and doubled as needed;
+ *  - a shared buffer of the connection, doubled as needed, so the key can be
+ *    passed straight to the *_prepare() functions.
+ * A builder is reset and reused without touching the allocator once its
+ * buffer has grown to fit the largest key built with it.
+ */
+
+enum {
+    CASTLE_KEY_BUILDER_USER,
+    CASTLE_KEY_BUILDER_MALLOC,
+    CASTLE_KEY_BUILDER_SHARED,
+};
+
+/**
+ * Initialise a builder which writes into buf, or into a malloc()ed buffer of
+ * at least size bytes if buf is NULL.
+ */
+int castle_key_builder_init(castle_key_builder *builder, void *buf, uint32_t size)
+{
+    memset(builder, 0, sizeof(*builder));
+
+    if (buf)
+    {
+        builder->kind = CASTLE_KEY_BUILDER_USER;
+        builder->buf = buf;
+        builder->size = size;
+        return 0;
+    }
+
+    if (size < castle_object_btree_key_header_size(1))
+        size = 64;
+
+    builder->kind = CASTLE_KEY_BUILDER_MALLOC;
+    builder->buf = malloc(size);
+    if (!builder->buf)
+        return -ENOMEM;
+    builder->size = size;
+
+    return 0;
+}
+
+/**
+ * Initialise a builder which writes into a shared buffer of conn, of at least
+ * size bytes to begin with.
+ */
+int castle_key_builder_init_shared(castle_key_builder *builder,
+                                   castle_connection *conn,
+                                   uint32_t size)
+{
+    uint32_t buf_size = PAGE_SIZE;
+    int err;
+
+    memset(builder, 0, sizeof(*builder));
+
+    while (buf_size < size)
+        buf_size <<= 1;
+
+    err = castle_shared_buffer_get(conn, buf_size, &builder->buf);
+    if (err)
+        return err;
+
+    builder->kind = CASTLE_KEY_BUILDER_SHARED;
+    builder->conn = conn;
+    builder->size = buf_size;
+
+    return 0;
+}
+
+/**
+ * Release the builder's buffer, unless it was supplied by the caller.  Keys
+ * built in it are no longer valid.
+ */
+void castle_key_builder_destroy(castle_key_builder *builder)
+{
+    switch (builder->kind)
+    {
+        case CASTLE_KEY_BUILDER_MALLOC:
+            free(builder->buf);
+            break;
+        case CASTLE_KEY_BUILDER_SHARED:
+            castle_shared_buffer_put(builder->conn, builder->buf, builder->size);
+            break;
+    }
+
+    builder->buf = NULL;
+    builder->size = 0;
+}
+
+/* Make room for at least need bytes, keeping what has been built so far. */
+static int castle_key_builder_grow(castle_key_builder *builder, uint64_t need)
+{
+    uint64_t size = builder->size ? builder->size : PAGE_SIZE;
+    char *buf;
+    int err;
+
+    if (need > UINT32_MAX)
+        return -E2BIG;
+
+    while (size < need)
+        size <<= 1;
+    if (size > UINT32_MAX)
+        size = need;
+
+    switch (builder->kind)
+    {
+        case CASTLE_KEY_BUILDER_MALLOC:
+            buf = realloc(builder->buf, size);
+            if (!buf)
+                return -ENOMEM;
+            break;
+
+        case CASTLE_KEY_BUILDER_SHARED:
+            err = castle_shared_buffer_get(builder->conn, size, &buf);
+            if (err)
+                return err;
+            memcpy(buf, builder->buf, builder->used);
+            castle_shared_buffer_put(builder->conn, builder->buf, builder->size);
+            break;
+
+        default:
+            return -ENOSPC;
+    }
+
+    builder->buf = buf;
+    builder->size = size;
+
+    return 0;
+}
+
+/**
+ * Start a new key of nr_dims dimensions, discarding the one being built.
+ */
+int castle_key_builder_reset(castle_key_builder *builder, uint32_t nr_dims)
+{
+    uint64_t header = castle_object_btree_key_header_size((uint64_t)nr_dims);
+    int err;
+
+    if (header > builder->size)
+    {
+        err = castle_key_builder_grow(builder, header);
+        if (err)
+            return err;
+    }
+
+    builder->nr_dims = nr_dims;
+    builder->dim = 0;
+    builder->used = header;
+
+    return 0;
+}
+
+/**
+ * Append the next dimension of the key.
+ *
+ * @param   flags   KEY_DIMENSION_*_FLAG
+ *
+ * @return -EINVAL  All nr_dims dimensions have already been appended
+ * @return -ENOSPC  The caller's buffer is full
+ */
+int castle_key_builder_append(castle_key_builder *builder,
+                              const void *data,
+                              uint32_t len,
+                              uint8_t flags)
+{
+    castle_key *key;
+    int err;
+
+    if (builder->dim >= builder->nr_dims)
+        return -EINVAL;
+    /* dim_head has 24 bits for the offset. */
+    if (builder->used >= 1U << (32 - KEY_DIMENSION_FLAGS_SHIFT))
+        return -E2BIG;
+
+    if ((uint64_t)builder->used + len > builder->size)
+    {
+        err = castle_key_builder_grow(builder, (uint64_t)builder->used + len);
+        if (err)
+            return err;
+    }
+
+    key = (castle_key *)builder->buf;
+    key->dim_head[builder->dim++] = KEY_DIMENSION_HEADER(builder->used, flags);
+    memcpy(builder->buf + builder->used, data, len);
+    builder->used += len;
+
+    return 0;
+}
+
+/**
+ * Complete the key.  It stays valid until the builder is next reset or
+ * destroyed.
+ *
+ * @return -EINVAL  Fewer than nr_dims dimensions have been appended
+ */
+int castle_key_builder_finish(castle_key_builder *builder,
+                              castle_key **key_out,
+                              uint32_t *key_len_out)
+{
+    castle_key *key = (castle_key *)builder->buf;
+
+    if (builder->dim != builder->nr_dims)
+        return -EINVAL;
+
+    key->length = builder->used - 4; /* Length doesn't include length field. */
+    key->nr_dims = builder->nr_dims;
+    memset(key->_unused, 0, sizeof(key->_unused));
+
+    *key_out = key;
+    if (key_len_out)
+        *key_len_out = builder->used;
+
+    return 0;
+}
+
+/*
+ * Key comparison, hashing and sorting.
+ *
+ * Keys are ordered as the btree orders them: dimension by dimension, where a
+ * dimension flagged KEY_DIMENSION_MINUS_INFINITY_FLAG sorts below every value
+ * and one flagged KEY_DIMENSION_PLUS_INFINITY_FLAG above every value, whatever
+ * their payload.  Other dimensions compare bytewise, a dimension sorting
+ * before any longer one it is a prefix of, and one flagged
+ * KEY_DIMENSION_NEXT_FLAG just after the same bytes unflagged.  A key sorts
+ * before any key with more dimensions which it is a prefix of.
+ */
+
+/* -1, 0 or 1 for a minus infinity, ordinary or plus infinity dimension. */
+static inline int castle_key_dim_rank(uint8_t flags)
+{
+    if (flags & KEY_DIMENSION_MINUS_INFINITY_FLAG)
+        return -1;
+    if (flags & KEY_DIMENSION_PLUS_INFINITY_FLAG)
+        return 1;
+    return 0;
+}
+
+/**
+ * Compare dimension elem_a of a with dimension elem_b of b.
+ */
+int castle_key_elem_compare(const castle_key *a, int elem_a, const castle_key *b, int elem_b)
+{
+    uint8_t flags_a = castle_key_elem_flags(a, elem_a), flags_b = castle_key_elem_flags(b, elem_b);
+    int rank_a = castle_key_dim_rank(flags_a), rank_b = castle_key_dim_rank(flags_b);
+    uint32_t len_a, len_b;
+    int cmp;
+
+    if (rank_a != rank_b)
+        return rank_a < rank_b ? -1 : 1;
+    if (rank_a)
+        return 0;
+
+    len_a = castle_key_elem_len(a, elem_a);
+    len_b = castle_key_elem_len(b, elem_b);
+    cmp = memcmp(castle_key_elem_data(a, elem_a), castle_key_elem_data(b, elem_b),
+                 len_a < len_b ? len_a : len_b);
+    if (cmp)
+        return cmp;
+    if (len_a != len_b)
+        return len_a < len_b ? -1 : 1;
+
+    flags_a &= KEY_DIMENSION_NEXT_FLAG;
+    flags_b &= KEY_DIMENSION_NEXT_FLAG;
+    if (flags_a != flags_b)
+        return flags_a ? 1 : -1;
+
+    return 0;
+}
+
+int castle_key_compare(const castle_key *a, const castle_key *b)
+{
+    uint32_t dims_a = castle_key_dims(a), dims_b = castle_key_dims(b);
+    int cmp;
+
+    for (uint32_t i = 0; i < dims_a && i < dims_b; i++)
+        if ((cmp = castle_key_elem_compare(a, i, b, i)))
+            return cmp;
+
+    return (dims_a > dims_b) - (dims_a < dims_b);
+}
+
+#define CASTLE_KEY_HASH_P1  0x9e3779b185ebca87ULL
+#define CASTLE_KEY_HASH_P2  0xc2b2ae3d27d4eb4fULL
+#define CASTLE_KEY_HASH_P3  0x165667b19e3779f9ULL
+
+static inline uint64_t castle_key_hash_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t castle_key_hash_round(uint64_t h, uint64_t word)
+{
+    h ^= castle_key_hash_rotl(word * CASTLE_KEY_HASH_P2, 31) * CASTLE_KEY_HASH_P1;
+    return castle_key_hash_rotl(h, 27) * CASTLE_KEY_HASH_P1 + CASTLE_KEY_HASH_P3;
+}
+
+/**
+ * 64-bit hash of key, consistent with castle_key_compare(): keys which compare
+ * equal hash equally, however they are laid out.  Payloads are consumed eight
+ * bytes at a time.
+ */
+uint64_t castle_key_hash(const castle_key *key, uint64_t seed)
+{
+    uint32_t dims = castle_key_dims(key);
+    uint64_t h = seed + CASTLE_KEY_HASH_P3 + dims;
+
+    for (uint32_t i = 0; i < dims; i++)
+    {
+        uint8_t flags = castle_key_elem_flags(key, i);
+        const uint8_t *data, *end;
+        uint64_t word;
+        uint32_t len;
+
+        if (castle_key_dim_rank(flags))
+        {
+            /* The payload of an infinity doesn't take part in comparisons. */
+            h = castle_key_hash_round(h, flags & KEY_DIMENSION_INFINITY_FLAGS_MASK);
+            continue;
+        }
+
+        len = castle_key_elem_len(key, i);
+        data = castle_key_elem_data(key, i);
+        end = data + len;
+        h = castle_key_hash_round(h, ((uint64_t)len << 8) | (flags & KEY_DIMENSION_NEXT_FLAG));
+
+        for (; end - data >= 8; data += 8)
+        {
+            memcpy(&word, data, sizeof(word));
+            h = castle_key_hash_round(h, word);
+        }
+        if (data < end)
+        {
+            word = 0;
+            memcpy(&word, data, end - data);
+            h = castle_key_hash_round(h, word);
+        }
+    }
+
+    h ^= h >> 33;
+    h *= CASTLE_KEY_HASH_P2;
+    h ^= h >> 29;
+    h *= CASTLE_KEY_HASH_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+struct castle_key_sort_entry
+{
+    uint64_t    prefix;
+    castle_key *key;
+};
+
+/*
+ * A 64-bit value which orders keys consistently with castle_key_compare(),
+ * though keys it can't tell apart may still differ: the rank of the first
+ * dimension followed by its first seven bytes, zero padded.
+ */
+static uint64_t castle_key_sort_prefix(const castle_key *key)
+{
+    uint8_t bytes[8] = { 0 };
+    uint64_t prefix;
+    uint32_t len;
+
+    if (castle_key_dims(key) == 0)
+        return 0;
+
+    bytes[0] = castle_key_dim_rank(castle_key_elem_flags(key, 0)) + 1;
+    if (bytes[0] == 1)
+    {
+        len = castle_key_elem_len(key, 0);
+        memcpy(bytes + 1, castle_key_elem_data(key, 0), len < 7 ? len : 7);
+    }
+
+    memcpy(&prefix, bytes, sizeof(prefix));
+
+    return be64toh(prefix);
+}
+
+static int castle_key_sort_cmp(const void *a, const void *b)
+{
+    const struct castle_key_sort_entry *entry_a = a, *entry_b = b;
+
+    if (entry_a->prefix != entry_b->prefix)
+        return entry_a->prefix < entry_b->prefix ? -1 : 1;
+
+    return castle_key_compare(entry_a->key, entry_b->key);
+}
+
+static int castle_key_ptr_cmp(const void *a, const void *b)
+{
+    return castle_key_compare(*(castle_key * const *)a, *(castle_key * const *)b);
+}
+
+/**
+ * Sort an array of keys into castle_key_compare() order.
+ *
+ * Keys are sorted by a cached prefix of their first dimension, so most
+ * comparisons don't touch the keys themselves.
+ */
+void castle_key_sort(castle_key **keys, size_t n)
+{
+    struct castle_key_sort_entry *entries;
+    size_t i;
+
+    if (n < 2)
+        return;
+
+    entries = malloc(n * sizeof(*entries));
+    if (!entries)
+    {
+        qsort(keys, n, sizeof(*keys), castle_key_ptr_cmp);
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        entries[i].prefix = castle_key_sort_prefix(keys[i]);
+        entries[i].key = keys[i];
+    }
+
+    qsort(entries, n, sizeof(*entries), castle_key_sort_cmp);
+
+    for (i = 0; i < n; i++)
+        keys[i] = entries[i].key;
+
+    free(entries);
+}
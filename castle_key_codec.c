@@ -0,0 +1,330 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <endian.h>
+
+#include "castle.h"
+
+/*
+ * Order-preserving typed encodings for key dimensions.
+ *
+ * The kernel compares dimensions as unsigned bytes, so values are encoded such
+ * that memcmp() order is their natural order:
+ *  - unsigned integers big-endian;
+ *  - signed integers big-endian with the sign bit flipped;
+ *  - doubles as their IEEE 754 bits, with the sign bit flipped for positive
+ *    values and every bit flipped for negative ones (-0.0 sorts just below
+ *    0.0, NaNs beyond the infinities);
+ *  - strings with each 0x00 byte escaped as 0x00 0xff and a 0x00 0x01
+ *    terminator, so a string sorts before any longer string it prefixes even
+ *    when more fields follow it in the same dimension;
+ *  - fixed-width binary as is.
+ * Fields of fixed width, and escaped strings, can be concatenated within one
+ * dimension to give a composite which sorts field by field.
+ *
+ * Decoders take a cursor into the encoded bytes, typically starting at
+ * castle_key_elem_data(), and advance it past the field they read.
+ */
+
+#define CASTLE_KEY_STRING_ESCAPE    0x00
+#define CASTLE_KEY_STRING_ESCAPED   0xff
+#define CASTLE_KEY_STRING_END       0x01
+
+static inline uint64_t castle_key_double_bits(double v)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &v, sizeof(bits));
+
+    return (bits & (1ULL << 63)) ? ~bits : bits ^ (1ULL << 63);
+}
+
+static inline double castle_key_bits_double(uint64_t bits)
+{
+    double v;
+
+    bits = (bits & (1ULL << 63)) ? bits ^ (1ULL << 63) : ~bits;
+    memcpy(&v, &bits, sizeof(v));
+
+    return v;
+}
+
+uint32_t castle_key_encode_u64(uint8_t *out, uint64_t v)
+{
+    v = htobe64(v);
+    memcpy(out, &v, sizeof(v));
+
+    return sizeof(v);
+}
+
+uint32_t castle_key_encode_i64(uint8_t *out, int64_t v)
+{
+    return castle_key_encode_u64(out, (uint64_t)v ^ (1ULL << 63));
+}
+
+uint32_t castle_key_encode_u32(uint8_t *out, uint32_t v)
+{
+    v = htobe32(v);
+    memcpy(out, &v, sizeof(v));
+
+    return sizeof(v);
+}
+
+uint32_t castle_key_encode_i32(uint8_t *out, int32_t v)
+{
+    return castle_key_encode_u32(out, (uint32_t)v ^ (1U << 31));
+}
+
+uint32_t castle_key_encode_double(uint8_t *out, double v)
+{
+    return castle_key_encode_u64(out, castle_key_double_bits(v));
+}
+
+/**
+ * Bytes castle_key_encode_string() will write for s.
+ */
+uint32_t castle_key_encoded_string_len(const void *s, uint32_t len)
+{
+    const uint8_t *p = s, *end = p + len;
+    uint32_t out_len = len + 2;
+
+    while ((p = memchr(p, CASTLE_KEY_STRING_ESCAPE, end - p)))
+    {
+        out_len++;
+        p++;
+    }
+
+    return out_len;
+}
+
+/**
+ * Encode len bytes of s.  out must have room for castle_key_encoded_string_len()
+ * bytes, which is at most 2 * len + 2.
+ */
+uint32_t castle_key_encode_string(uint8_t *out, const void *s, uint32_t len)
+{
+    const uint8_t *p = s, *end = p + len, *zero;
+    uint8_t *o = out;
+
+    while ((zero = memchr(p, CASTLE_KEY_STRING_ESCAPE, end - p)))
+    {
+        memcpy(o, p, zero - p);
+        o += zero - p;
+        *o++ = CASTLE_KEY_STRING_ESCAPE;
+        *o++ = CASTLE_KEY_STRING_ESCAPED;
+        p = zero + 1;
+    }
+    memcpy(o, p, end - p);
+    o += end - p;
+    *o++ = CASTLE_KEY_STRING_ESCAPE;
+    *o++ = CASTLE_KEY_STRING_END;
+
+    return o - out;
+}
+
+uint32_t castle_key_encode_binary(uint8_t *out, const void *data, uint32_t len)
+{
+    memcpy(out, data, len);
+
+    return len;
+}
+
+/*
+ * Batch encoders, for filling a bulk load.  n values are written back to back,
+ * each taking the fixed width of its type.
+ */
+
+void castle_key_encode_u64_batch(uint8_t *out, const uint64_t *v, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t be = htobe64(v[i]);
+        memcpy(out + i * sizeof(be), &be, sizeof(be));
+    }
+}
+
+void castle_key_encode_i64_batch(uint8_t *out, const int64_t *v, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t be = htobe64((uint64_t)v[i] ^ (1ULL << 63));
+        memcpy(out + i * sizeof(be), &be, sizeof(be));
+    }
+}
+
+void castle_key_encode_double_batch(uint8_t *out, const double *v, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t be = htobe64(castle_key_double_bits(v[i]));
+        memcpy(out + i * sizeof(be), &be, sizeof(be));
+    }
+}
+
+/*
+ * Decoders.  Each reads one field at *p, which must not pass end, and advances
+ * *p past it.
+ *
+ * @return -EINVAL  The field is truncated or badly escaped
+ */
+
+int castle_key_decode_u64(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    uint64_t be;
+
+    if (end - *p < (ptrdiff_t)sizeof(be))
+        return -EINVAL;
+
+    memcpy(&be, *p, sizeof(be));
+    *p += sizeof(be);
+    *v = be64toh(be);
+
+    return 0;
+}
+
+int castle_key_decode_i64(const uint8_t **p, const uint8_t *end, int64_t *v)
+{
+    uint64_t u;
+    int err;
+
+    if ((err = castle_key_decode_u64(p, end, &u)))
+        return err;
+    *v = (int64_t)(u ^ (1ULL << 63));
+
+    return 0;
+}
+
+int castle_key_decode_u32(const uint8_t **p, const uint8_t *end, uint32_t *v)
+{
+    uint32_t be;
+
+    if (end - *p < (ptrdiff_t)sizeof(be))
+        return -EINVAL;
+
+    memcpy(&be, *p, sizeof(be));
+    *p += sizeof(be);
+    *v = be32toh(be);
+
+    return 0;
+}
+
+int castle_key_decode_i32(const uint8_t **p, const uint8_t *end, int32_t *v)
+{
+    uint32_t u;
+    int err;
+
+    if ((err = castle_key_decode_u32(p, end, &u)))
+        return err;
+    *v = (int32_t)(u ^ (1U << 31));
+
+    return 0;
+}
+
+int castle_key_decode_double(const uint8_t **p, const uint8_t *end, double *v)
+{
+    uint64_t bits;
+    int err;
+
+    if ((err = castle_key_decode_u64(p, end, &bits)))
+        return err;
+    *v = castle_key_bits_double(bits);
+
+    return 0;
+}
+
+/**
+ * Decode a string into out, of out_len bytes.
+ *
+ * @param   [out]   len     Length of the decoded string
+ *
+ * @return -ENOSPC  out is too small; *len is the length needed and *p is
+ *                  left where it was
+ */
+int castle_key_decode_string(const uint8_t **p, const uint8_t *end,
+                             void *out, uint32_t out_len, uint32_t *len)
+{
+    const uint8_t *in = *p;
+    uint8_t *o = out;
+    uint32_t n = 0;
+
+    for (;;)
+    {
+        const uint8_t *zero = memchr(in, CASTLE_KEY_STRING_ESCAPE, end - in);
+
+        if (!zero || zero + 1 == end)
+            return -EINVAL;
+
+        if (n + (zero - in) <= out_len)
+            memcpy(o + n, in, zero - in);
+        n += zero - in;
+        in = zero + 2;
+
+        if (zero[1] == CASTLE_KEY_STRING_END)
+            break;
+        if (zero[1] != CASTLE_KEY_STRING_ESCAPED)
+            return -EINVAL;
+
+        if (n < out_len)
+            o[n] = 0;
+        n++;
+    }
+
+    *len = n;
+    if (n > out_len)
+        return -ENOSPC;
+    *p = in;
+
+    return 0;
+}
+
+int castle_key_decode_binary(const uint8_t **p, const uint8_t *end, void *out, uint32_t len)
+{
+    if ((uint64_t)(end - *p) < len)
+        return -EINVAL;
+
+    memcpy(out, *p, len);
+    *p += len;
+
+    return 0;
+}
+
+/*
+ * Single-field dimensions, read straight from a key.
+ *
+ * @return -EINVAL  The dimension isn't exactly one field of the type
+ */
+
+int castle_key_elem_u64(const castle_key *key, int elem, uint64_t *v)
+{
+    const uint8_t *p = castle_key_elem_data(key, elem);
+    const uint8_t *end = p + castle_key_elem_len(key, elem);
+
+    if (castle_key_decode_u64(&p, end, v) || p != end)
+        return -EINVAL;
+
+    return 0;
+}
+
+int castle_key_elem_i64(const castle_key *key, int elem, int64_t *v)
+{
+    const uint8_t *p = castle_key_elem_data(key, elem);
+    const uint8_t *end = p + castle_key_elem_len(key, elem);
+
+    if (castle_key_decode_i64(&p, end, v) || p != end)
+        return -EINVAL;
+
+    return 0;
+}
+
+int castle_key_elem_double(const castle_key *key, int elem, double *v)
+{
+    const uint8_t *p = castle_key_elem_data(key, elem);
+    const uint8_t *end = p + castle_key_elem_len(key, elem);
+
+    if (castle_key_decode_double(&p, end, v) || p != end)
+        return -EINVAL;
+
+    return 0;
+}
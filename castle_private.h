@@ -13,6 +13,63 @@ DEFINE_RING_TYPES(castle, castle_request_t, castle_response_t);
 
 int castle_protocol_version(struct castle_front_connection *conn);
 
+void castle_request_submit(struct castle_front_connection *conn,
+                           castle_request_t *req,
+                           struct castle_blocking_call *blocking_calls,
+                           int count);
+int castle_request_wait(struct castle_front_connection *conn,
+                        struct castle_blocking_call *blocking_call);
+int castle_shared_buffer_get(struct castle_front_connection *conn,
+                             unsigned long size, char **buffer_out);
+void castle_shared_buffer_put(struct castle_front_connection *conn,
+                              char *buffer, unsigned long size);
+uint32_t castle_key_buffer_len(castle_key *key);
+void castle_key_buffer_fill(castle_key *key, char *key_buf, uint32_t key_len);
+int castle_make_2key_buffer(struct castle_front_connection *conn,
+                            castle_key *key1, castle_key *key2, char **key_buf_out,
+                            uint32_t *key1_len_out, uint32_t *key2_len_out);
+#define VALUE_INLINE(_type)     ((_type == CASTLE_VALUE_TYPE_INLINE) ||             \
+                                 (_type == CASTLE_VALUE_TYPE_INLINE_COUNTER))
+
+int castle_write_behind_put(struct castle_front_connection *conn,
+                            c_collection_id_t collection, castle_key *key,
+                            const char *value, uint32_t value_len, uint8_t type);
+int castle_write_behind_get(struct castle_front_connection *conn,
+                            c_collection_id_t collection, castle_key *key,
+                            char **value_out, uint32_t *value_len_out);
+int castle_write_behind_pending(struct castle_front_connection *conn,
+                                c_collection_id_t collection, castle_key *key);
+int castle_write_multi_send(struct castle_front_connection *conn,
+                            const struct castle_write_op *ops, unsigned int count, int *errs);
+int castle_read_cache_enabled(void);
+int castle_read_cache_lookup(c_collection_id_t collection, castle_key *key,
+                             char **value_out, uint32_t *value_len_out, uint64_t *gen);
+void castle_read_cache_fill(c_collection_id_t collection, castle_key *key,
+                            const char *value, uint32_t value_len,
+                            castle_user_timestamp_t timestamp, uint64_t gen);
+void castle_read_cache_invalidate(c_collection_id_t collection, castle_key *key);
+int castle_single_flight_enabled(void);
+int castle_single_flight_get(struct castle_front_connection *conn,
+                             c_collection_id_t collection, castle_key *key, uint64_t cache_gen,
+                             char **value_out, uint32_t *value_len_out);
+void castle_single_flight_forget(c_collection_id_t collection, castle_key *key);
+int castle_key_elem_compare(const castle_key *a, int elem_a, const castle_key *b, int elem_b);
+int castle_cursor_start_submit(struct castle_front_connection *conn,
+                               c_collection_id_t collection, castle_key *start_key,
+                               castle_key *end_key, uint32_t buf_size, uint8_t flags,
+                               castle_cursor **cursor_out);
+int castle_cursor_start_wait(castle_cursor *cursor);
+int castle_get_fetch(struct castle_front_connection *conn,
+                     c_collection_id_t collection, castle_key *key, uint64_t cache_gen,
+                     char **value_out, uint32_t *value_len_out);
+
+int castle_request_send_nowait(struct castle_front_connection *conn,
+                               castle_request_t *req,
+                               castle_callback callback,
+                               void *data);
+int castle_request_poll(struct castle_front_connection *conn,
+                        struct castle_blocking_call *blocking_call);
+
 struct castle_front_callback
 {
     struct list_head    list;
@@ -21,6 +78,12 @@ struct castle_front_callback
     castle_interface_token_t token;
 };
 
+/* Shared buffers of PAGE_SIZE << n bytes, for n < CASTLE_BUFFER_CACHE_CLASSES,
+ * are recycled per connection rather than mapped and unmapped for each use. */
+#define CASTLE_BUFFER_CACHE_CLASSES 9
+/* Approximate number of bytes kept cached in each size class. */
+#define CASTLE_BUFFER_CACHE_CLASS_BYTES (1024 * 1024)
+
 struct castle_front_connection
 {
     int                 fd; /* tests rely on this being the first field */
@@ -47,6 +110,19 @@ struct castle_front_connection
 
     int debug_flags;
     FILE *              debug_log;
+
+    /* free lists of shared buffers, linked through their first word */
+    pthread_mutex_t     buffer_cache_mutex;
+    char               *buffer_cache[CASTLE_BUFFER_CACHE_CLASSES];
+    unsigned int        buffer_cache_count[CASTLE_BUFFER_CACHE_CLASSES];
+
+    /* iterator traffic, see castle_iter_stats_get() */
+    uint64_t            iter_round_trips;
+    uint64_t            iter_entries;
+    uint64_t            iter_bytes;
+
+    /* buffered replaces and removes, see castle_write_behind_enable() */
+    struct castle_write_behind *write_behind;
 } PACKED;
 
 #define DEBUG_REQS 1
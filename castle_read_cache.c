@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "castle.h"
+#include "castle_private.h"
+#include "list.h"
+
+/*
+ * Process-wide read cache for castle_get().
+ *
+ * Values up to PAGE_SIZE returned by castle_get() on any connection are kept,
+ * keyed by (collection, key), in one of CASTLE_READ_CACHE_SHARDS independently
+ * locked shards.  Each shard has an equal part of the byte budget and evicts
+ * with CLOCK: entries sit in a FIFO ring, a hit sets the entry's reference bit,
+ * and eviction gives referenced entries a second pass round the ring.
+ *
+ * Writes made through libcastle in this process invalidate the key, both when
+ * they are sent and when they complete.  Writes from elsewhere are only
+ * bounded by the TTL.  Every invalidation bumps its shard's generation, and a
+ * get only fills the cache if the generation is unchanged since its miss, so a
+ * read which raced with a write can't leave the old value behind.  Gets ask
+ * for the value timestamp, and a fill never replaces an entry with a newer
+ * one.
+ */
+
+#define CASTLE_READ_CACHE_SHARDS    16
+#define CASTLE_READ_CACHE_BUCKETS   4096    /* per shard */
+
+struct castle_read_cache_entry
+{
+    struct castle_read_cache_entry *hash_next;
+    struct list_head                clock;
+    c_collection_id_t               collection;
+    uint32_t                        hash;
+    int                             ref;
+    uint64_t                        expires_ms;
+    castle_user_timestamp_t         timestamp;
+    castle_key                     *key;    /**< Copy of the key, following the entry       */
+    char                           *value;  /**< Copy of the value, following the key       */
+    uint32_t                        value_len;
+    uint32_t                        size;   /**< Bytes charged against the budget           */
+};
+
+struct castle_read_cache_shard
+{
+    pthread_mutex_t                 lock;
+    struct castle_read_cache_entry *buckets[CASTLE_READ_CACHE_BUCKETS];
+    struct list_head                clock;
+    uint64_t                        bytes;
+    uint64_t                        gen;
+};
+
+struct castle_read_cache
+{
+    uint64_t                        max_shard_bytes;
+    unsigned int                    ttl_ms;
+    struct castle_read_cache_shard  shards[CASTLE_READ_CACHE_SHARDS];
+    struct castle_read_cache_stats  stats;
+};
+
+static struct castle_read_cache *read_cache;
+
+static uint64_t castle_read_cache_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static struct castle_read_cache_entry **castle_read_cache_find(struct castle_read_cache_shard *shard,
+                                                               c_collection_id_t collection,
+                                                               castle_key *key, uint32_t hash)
+{
+    struct castle_read_cache_entry **p = &shard->buckets[(hash / CASTLE_READ_CACHE_SHARDS)
+                                                         % CASTLE_READ_CACHE_BUCKETS];
+
+    for (; *p; p = &(*p)->hash_next)
+        if ((*p)->hash == hash && (*p)->collection == collection
+                && castle_key_compare((*p)->key, key) == 0)
+            break;
+
+    return p;
+}
+
+/* Unlink and free the entry at *p.  Called with the shard lock held. */
+static void castle_read_cache_drop(struct castle_read_cache_shard *shard,
+                                   struct castle_read_cache_entry **p)
+{
+    struct castle_read_cache_entry *entry = *p;
+
+    *p = entry->hash_next;
+    list_del(&entry->clock);
+    shard->bytes -= entry->size;
+    free(entry);
+}
+
+/* Evict until size more bytes fit.  Called with the shard lock held. */
+static void castle_read_cache_evict(struct castle_read_cache *cache,
+                                    struct castle_read_cache_shard *shard, uint64_t size)
+{
+    while (shard->bytes + size > cache->max_shard_bytes && !list_empty(&shard->clock))
+    {
+        struct castle_read_cache_entry *entry =
+            list_first_entry(&shard->clock, struct castle_read_cache_entry, clock);
+
+        if (entry->ref)
+        {
+            entry->ref = 0;
+            list_move_tail(&entry->clock, &shard->clock);
+            continue;
+        }
+
+        castle_read_cache_drop(shard, castle_read_cache_find(shard, entry->collection,
+                                                             entry->key, entry->hash));
+        __sync_fetch_and_add(&cache->stats.evictions, 1);
+    }
+}
+
+/**
+ * Cache castle_get() results across the process, see above.
+ *
+ * @param   max_bytes   Memory to use for cached keys and values
+ * @param   ttl_ms      Longest a value is served from the cache; 0 => no limit
+ *
+ * Not safe against concurrent castle_get() calls.
+ */
+int castle_read_cache_enable(uint64_t max_bytes, unsigned int ttl_ms)
+{
+    struct castle_read_cache *cache;
+
+    if (read_cache)
+        return -EEXIST;
+    if (max_bytes == 0)
+        return -EINVAL;
+
+    cache = calloc(1, sizeof(*cache));
+    if (!cache)
+        return -ENOMEM;
+
+    cache->max_shard_bytes = max_bytes / CASTLE_READ_CACHE_SHARDS;
+    cache->ttl_ms = ttl_ms;
+    for (int i = 0; i < CASTLE_READ_CACHE_SHARDS; i++)
+    {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+        INIT_LIST_HEAD(&cache->shards[i].clock);
+    }
+
+    read_cache = cache;
+
+    return 0;
+}
+
+/**
+ * Drop the read cache.  Not safe against concurrent castle_get() calls.
+ */
+void castle_read_cache_disable(void)
+{
+    struct castle_read_cache *cache = read_cache;
+    struct castle_read_cache_entry *entry, *next;
+
+    if (!cache)
+        return;
+
+    read_cache = NULL;
+
+    for (int i = 0; i < CASTLE_READ_CACHE_SHARDS; i++)
+    {
+        list_for_each_entry_safe(entry, next, &cache->shards[i].clock, clock)
+            free(entry);
+        pthread_mutex_destroy(&cache->shards[i].lock);
+    }
+
+    free(cache);
+}
+
+void castle_read_cache_stats_get(struct castle_read_cache_stats *stats)
+{
+    struct castle_read_cache *cache = read_cache;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!cache)
+        return;
+
+    stats->hits          = __sync_fetch_and_add(&cache->stats.hits, 0);
+    stats->misses        = __sync_fetch_and_add(&cache->stats.misses, 0);
+    stats->fills         = __sync_fetch_and_add(&cache->stats.fills, 0);
+    stats->stale_fills   = __sync_fetch_and_add(&cache->stats.stale_fills, 0);
+    stats->evictions     = __sync_fetch_and_add(&cache->stats.evictions, 0);
+    stats->invalidations = __sync_fetch_and_add(&cache->stats.invalidations, 0);
+    for (int i = 0; i < CASTLE_READ_CACHE_SHARDS; i++)
+    {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        stats->bytes += cache->shards[i].bytes;
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+}
+
+int castle_read_cache_enabled(void)
+{
+    return read_cache != NULL;
+}
+
+/**
+ * Look key up in the read cache.
+ *
+ * @param   [out]   gen     Shard generation to pass to castle_read_cache_fill()
+ *                          after a miss
+ *
+ * @return  0 and a malloc()ed copy of the value on a hit
+ * @return  1 on a miss
+ */
+int castle_read_cache_lookup(c_collection_id_t collection,
+                             castle_key *key,
+                             char **value_out,
+                             uint32_t *value_len_out,
+                             uint64_t *gen)
+{
+    struct castle_read_cache *cache = read_cache;
+    uint32_t hash = castle_key_hash(key, collection);
+    struct castle_read_cache_shard *shard = &cache->shards[hash % CASTLE_READ_CACHE_SHARDS];
+    struct castle_read_cache_entry **p, *entry;
+    int ret = 1;
+
+    pthread_mutex_lock(&shard->lock);
+    *gen = shard->gen;
+    p = castle_read_cache_find(shard, collection, key, hash);
+    entry = *p;
+    if (entry && cache->ttl_ms && entry->expires_ms <= castle_read_cache_now_ms())
+    {
+        castle_read_cache_drop(shard, p);
+        entry = NULL;
+    }
+    if (entry)
+    {
+        char *value = malloc(entry->value_len ? entry->value_len : 1);
+        if (value)
+        {
+            memcpy(value, entry->value, entry->value_len);
+            *value_out = value;
+            *value_len_out = entry->value_len;
+            entry->ref = 1;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    __sync_fetch_and_add(ret ? &cache->stats.misses : &cache->stats.hits, 1);
+
+    return ret;
+}
+
+/**
+ * Offer a value read from the kernel after a miss.
+ */
+void castle_read_cache_fill(c_collection_id_t collection,
+                            castle_key *key,
+                            const char *value,
+                            uint32_t value_len,
+                            castle_user_timestamp_t timestamp,
+                            uint64_t gen)
+{
+    struct castle_read_cache *cache = read_cache;
+    uint32_t hash = castle_key_hash(key, collection);
+    struct castle_read_cache_shard *shard = &cache->shards[hash % CASTLE_READ_CACHE_SHARDS];
+    uint32_t key_len = castle_key_length(key);
+    uint32_t size = sizeof(struct castle_read_cache_entry) + key_len + value_len;
+    struct castle_read_cache_entry **p, *entry;
+
+    if (size > cache->max_shard_bytes)
+        return;
+
+    entry = malloc(size);
+    if (!entry)
+        return;
+    entry->collection = collection;
+    entry->hash = hash;
+    entry->ref = 0;
+    entry->expires_ms = cache->ttl_ms ? castle_read_cache_now_ms() + cache->ttl_ms : 0;
+    entry->timestamp = timestamp;
+    entry->key = (castle_key *)(entry + 1);
+    memcpy(entry->key, key, key_len);
+    entry->value = (char *)entry->key + key_len;
+    entry->value_len = value_len;
+    memcpy(entry->value, value, value_len);
+    entry->size = size;
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->gen != gen)
+        goto stale;
+
+    p = castle_read_cache_find(shard, collection, key, hash);
+    if (*p)
+    {
+        if ((*p)->timestamp > timestamp)
+            goto stale;
+        castle_read_cache_drop(shard, p);
+    }
+
+    castle_read_cache_evict(cache, shard, size);
+
+    p = castle_read_cache_find(shard, collection, key, hash);
+    entry->hash_next = NULL;
+    *p = entry;
+    list_add_tail(&entry->clock, &shard->clock);
+    shard->bytes += size;
+    pthread_mutex_unlock(&shard->lock);
+
+    __sync_fetch_and_add(&cache->stats.fills, 1);
+    return;
+
+stale:
+    pthread_mutex_unlock(&shard->lock);
+    free(entry);
+    __sync_fetch_and_add(&cache->stats.stale_fills, 1);
+}
+
+/**
+ * Forget key, and stop gets already in flight for keys in its shard from
+ * filling the cache.
+ */
+void castle_read_cache_invalidate(c_collection_id_t collection, castle_key *key)
+{
+    struct castle_read_cache *cache = read_cache;
+    struct castle_read_cache_shard *shard;
+    struct castle_read_cache_entry **p;
+    uint32_t hash;
+
+    if (!cache)
+        return;
+
+    hash = castle_key_hash(key, collection);
+    shard = &cache->shards[hash % CASTLE_READ_CACHE_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    shard->gen++;
+    p = castle_read_cache_find(shard, collection, key, hash);
+    if (*p)
+        castle_read_cache_drop(shard, p);
+    pthread_mutex_unlock(&shard->lock);
+
+    __sync_fetch_and_add(&cache->stats.invalidations, 1);
+}
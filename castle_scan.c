@@ -0,0 +1,846 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <alloca.h>
+
+#include "castle.h"
+#include "castle_private.h"
+
+/*
+ * Parallel range scans.
+ *
+ * The range [start_key, end_key] is cut into sub-ranges which differ only in
+ * the first dimension where start_key and end_key differ (the split
+ * dimension); all earlier dimensions are equal throughout, so the sub-ranges
+ * are also ordered with respect to each other.  Each sub-range is read by its
+ * own worker thread through a prefetching cursor on its own connection, and so
+ * its own ring.
+ *
+ * Split points come from the caller, as keys whose split-dimension elements
+ * are the boundaries, or else are interpolated between the split-dimension
+ * elements of start_key and end_key.  A boundary belongs to the sub-range
+ * above it.
+ */
+
+#define CASTLE_SCAN_PREFETCH        4
+/* Bytes of the split dimension used when interpolating split points. */
+#define CASTLE_SCAN_SPLIT_BYTES     8
+
+struct castle_scan_boundary
+{
+    const uint8_t  *data;
+    uint32_t        len;
+};
+
+struct castle_scan
+{
+    c_collection_id_t     collection;
+    castle_key           *start_key;
+    castle_key           *end_key;
+    uint32_t              dim;              /**< Split dimension                            */
+    struct castle_scan_boundary *bounds;    /**< nr_workers - 1 split points                */
+    unsigned int          nr_workers;
+    uint8_t               flags;
+    unsigned int          scan_flags;
+    castle_scan_fn        callback;
+    void                 *userdata;
+
+    pthread_mutex_t       lock;
+    pthread_cond_t        cond;
+    unsigned int          turn;             /**< Worker allowed to deliver, if ordered      */
+    int                   stop;
+    int                   err;
+};
+
+struct castle_scan_worker
+{
+    struct castle_scan   *scan;
+    unsigned int          idx;
+    pthread_t             thread;
+};
+
+/* Compare a key element with a split point, as the btree orders elements. */
+static int castle_scan_elem_cmp(const uint8_t *data, uint32_t len, const struct castle_scan_boundary *b)
+{
+    int cmp = memcmp(data, b->data, len < b->len ? len : b->len);
+
+    if (cmp)
+        return cmp;
+
+    return (len > b->len) - (len < b->len);
+}
+
+/*
+ * Build a copy of key with the split dimension replaced by bound, and every
+ * later dimension by an infinity: KEY_DIMENSION_MINUS_INFINITY_FLAG for a
+ * sub-range start, KEY_DIMENSION_PLUS_INFINITY_FLAG for an end.  Keeping key's
+ * own later dimensions would leave out the keys at the boundary whose later
+ * dimensions are below start_key's, or above end_key's.
+ */
+static castle_key *castle_scan_key_with_bound(castle_key *key, uint32_t dim,
+                                              const struct castle_scan_boundary *bound,
+                                              uint8_t inner_flags)
+{
+    uint32_t dims = castle_key_dims(key);
+    int *lens = alloca(dims * sizeof(*lens));
+    const uint8_t **elems = alloca(dims * sizeof(*elems));
+    uint8_t *elem_flags = alloca(dims * sizeof(*elem_flags));
+
+    for (uint32_t i = 0; i < dims; i++)
+    {
+        lens[i] = castle_key_elem_len(key, i);
+        elems[i] = castle_key_elem_data(key, i);
+        elem_flags[i] = castle_key_elem_flags(key, i);
+    }
+
+    lens[dim] = bound->len;
+    elems[dim] = bound->data;
+    elem_flags[dim] = 0;
+
+    for (uint32_t i = dim + 1; i < dims; i++)
+    {
+        lens[i] = 0;
+        elems[i] = (const uint8_t *)"";
+        elem_flags[i] = inner_flags;
+    }
+
+    return castle_malloc_key(dims, lens, elems, elem_flags);
+}
+
+/* Read the leading bytes of a split-dimension element as a big-endian number. */
+static uint64_t castle_scan_elem_value(castle_key *key, uint32_t dim, uint64_t infinity)
+{
+    uint8_t flags = castle_key_elem_flags(key, dim);
+    const uint8_t *data = castle_key_elem_data(key, dim);
+    uint32_t len = castle_key_elem_len(key, dim);
+    uint64_t value = 0;
+
+    if (flags & KEY_DIMENSION_MINUS_INFINITY_FLAG)
+        return 0;
+    if (flags & KEY_DIMENSION_PLUS_INFINITY_FLAG)
+        return infinity;
+
+    for (int i = 0; i < CASTLE_SCAN_SPLIT_BYTES; i++)
+        value = (value << 8) | (i < (int)len ? data[i] : 0);
+
+    return value;
+}
+
+/*
+ * Interpolate split points into bytes.  Returns the number of workers the range
+ * supports, which may be fewer than asked for if it is narrow.
+ */
+static unsigned int castle_scan_interpolate(struct castle_scan *scan, uint8_t *bytes)
+{
+    uint64_t lo = castle_scan_elem_value(scan->start_key, scan->dim, 0);
+    uint64_t hi = castle_scan_elem_value(scan->end_key, scan->dim, UINT64_MAX);
+    unsigned int n = scan->nr_workers;
+    uint64_t step;
+
+    if (hi <= lo)
+        return 1;
+
+    while (n > 1 && (hi - lo) / n == 0)
+        n--;
+    step = (hi - lo) / n;
+
+    for (unsigned int i = 1; i < n; i++)
+    {
+        uint64_t point = lo + step * i;
+        uint8_t *p = bytes + (i - 1) * CASTLE_SCAN_SPLIT_BYTES;
+
+        for (int j = CASTLE_SCAN_SPLIT_BYTES - 1; j >= 0; j--, point >>= 8)
+            p[j] = point & 0xff;
+
+        scan->bounds[i - 1].data = p;
+        scan->bounds[i - 1].len = CASTLE_SCAN_SPLIT_BYTES;
+    }
+
+    return n;
+}
+
+static void castle_scan_stop(struct castle_scan *scan, int err)
+{
+    pthread_mutex_lock(&scan->lock);
+    scan->stop = 1;
+    if (!scan->err)
+        scan->err = err;
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+/* In ordered mode, wait for the workers below this one to finish delivering. */
+static int castle_scan_wait_turn(struct castle_scan *scan, unsigned int idx)
+{
+    int stop;
+
+    pthread_mutex_lock(&scan->lock);
+    while (scan->turn != idx && !scan->stop)
+        pthread_cond_wait(&scan->cond, &scan->lock);
+    stop = scan->stop;
+    pthread_mutex_unlock(&scan->lock);
+
+    return stop;
+}
+
+static void castle_scan_pass_turn(struct castle_scan *scan, unsigned int idx)
+{
+    pthread_mutex_lock(&scan->lock);
+    scan->turn = idx + 1;
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static void *castle_scan_worker_run(void *data)
+{
+    struct castle_scan_worker *worker = data;
+    struct castle_scan *scan = worker->scan;
+    const struct castle_scan_boundary *upper = NULL;
+    castle_key *start = scan->start_key, *end = scan->end_key;
+    struct castle_key_value_list *kv;
+    castle_connection *conn;
+    castle_cursor *cursor;
+    int ret = 0, err;
+
+    err = castle_connect(&conn);
+    if (err)
+        goto err0;
+
+    if (worker->idx > 0)
+    {
+        start = castle_scan_key_with_bound(scan->start_key, scan->dim, &scan->bounds[worker->idx - 1],
+                                           KEY_DIMENSION_MINUS_INFINITY_FLAG);
+        if (!start)
+        {
+            err = -ENOMEM;
+            goto err1;
+        }
+    }
+    if (worker->idx < scan->nr_workers - 1)
+    {
+        upper = &scan->bounds[worker->idx];
+        end = castle_scan_key_with_bound(scan->end_key, scan->dim, upper,
+                                         KEY_DIMENSION_PLUS_INFINITY_FLAG);
+        if (!end)
+        {
+            err = -ENOMEM;
+            goto err2;
+        }
+    }
+
+    err = castle_cursor_start(conn, scan->collection, start, end,
+                              castle_max_buffer_size(), scan->flags, &cursor);
+    if (err)
+        goto err3;
+
+    err = castle_cursor_prefetch(cursor, CASTLE_SCAN_PREFETCH);
+    if (err)
+        goto err4;
+
+    if ((scan->scan_flags & CASTLE_SCAN_ORDERED) && castle_scan_wait_turn(scan, worker->idx))
+        goto err4;
+
+    while (!scan->stop && (ret = castle_cursor_next(cursor, &kv)) > 0)
+    {
+        /* The upper boundary belongs to the next sub-range.  Every dimension
+         * before the split one is the same throughout the scan (it is the
+         * first where start_key and end_key differ), so keys arrive in order
+         * of the split dimension and nothing after the boundary is ours. */
+        if (upper && castle_scan_elem_cmp(castle_key_elem_data(kv->key, scan->dim),
+                                          castle_key_elem_len(kv->key, scan->dim), upper) >= 0)
+            break;
+
+        ret = scan->callback(worker->idx, kv, scan->userdata);
+        if (ret)
+        {
+            castle_scan_stop(scan, ret < 0 ? ret : 0);
+            break;
+        }
+    }
+    if (ret < 0)
+        err = ret;
+
+err4:
+    ret = castle_cursor_finish(cursor);
+    if (!err)
+        err = ret;
+err3:
+    if (end != scan->end_key)
+        free(end);
+err2:
+    if (start != scan->start_key)
+        free(start);
+err1:
+    castle_free(conn);
+err0:
+    if (err)
+        castle_scan_stop(scan, err);
+    if (scan->scan_flags & CASTLE_SCAN_ORDERED)
+        castle_scan_pass_turn(scan, worker->idx);
+
+    return NULL;
+}
+
+/**
+ * Scan [start_key, end_key] with up to nr_workers threads, each on its own
+ * connection.
+ *
+ * @param   split_keys  nr_workers - 1 ascending keys whose elements in the split
+ *                      dimension give the sub-range boundaries, or NULL to
+ *                      interpolate them
+ * @param   flags       CASTLE_RING_FLAGs for the iterators
+ * @param   scan_flags  CASTLE_SCAN_ORDERED to deliver every key in order, one
+ *                      worker at a time; otherwise workers call back concurrently
+ * @param   callback    Called for each key with the worker index.  The entry is
+ *                      only valid during the call.  A non-zero return stops the
+ *                      scan; a negative one is also returned as the error.
+ *
+ * @return  0 on success, or the first error met by any worker
+ */
+int castle_parallel_scan(c_collection_id_t collection,
+                         castle_key *start_key,
+                         castle_key *end_key,
+                         castle_key **split_keys,
+                         unsigned int nr_workers,
+                         uint8_t flags,
+                         unsigned int scan_flags,
+                         castle_scan_fn callback,
+                         void *userdata)
+{
+    struct castle_scan_worker *workers;
+    struct castle_scan scan;
+    uint8_t *split_bytes = NULL;
+    uint32_t dims, dim;
+    unsigned int i, started;
+    int err = 0;
+
+    dims = castle_key_dims(start_key);
+    if (nr_workers < 1 || dims < 1 || dims != castle_key_dims(end_key))
+        return -EINVAL;
+
+    /* Find the split dimension. */
+    for (dim = 0; dim < dims - 1; dim++)
+        if (castle_key_elem_flags(start_key, dim) != castle_key_elem_flags(end_key, dim)
+                || castle_key_elem_len(start_key, dim) != castle_key_elem_len(end_key, dim)
+                || memcmp(castle_key_elem_data(start_key, dim), castle_key_elem_data(end_key, dim),
+                          castle_key_elem_len(start_key, dim)))
+            break;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.collection = collection;
+    scan.start_key = start_key;
+    scan.end_key = end_key;
+    scan.dim = dim;
+    scan.nr_workers = nr_workers;
+    scan.flags = flags;
+    scan.scan_flags = scan_flags;
+    scan.callback = callback;
+    scan.userdata = userdata;
+
+    workers = calloc(nr_workers, sizeof(*workers));
+    scan.bounds = calloc(nr_workers, sizeof(*scan.bounds));
+    if (!workers || !scan.bounds)
+    {
+        err = -ENOMEM;
+        goto out0;
+    }
+
+    if (split_keys)
+    {
+        for (i = 0; i < nr_workers - 1; i++)
+        {
+            if (castle_key_dims(split_keys[i]) <= dim)
+            {
+                err = -EINVAL;
+                goto out0;
+            }
+            scan.bounds[i].data = castle_key_elem_data(split_keys[i], dim);
+            scan.bounds[i].len = castle_key_elem_len(split_keys[i], dim);
+        }
+    }
+    else if (nr_workers > 1)
+    {
+        split_bytes = malloc((nr_workers - 1) * CASTLE_SCAN_SPLIT_BYTES);
+        if (!split_bytes)
+        {
+            err = -ENOMEM;
+            goto out0;
+        }
+        scan.nr_workers = castle_scan_interpolate(&scan, split_bytes);
+    }
+
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.cond, NULL);
+
+    for (started = 0; started < scan.nr_workers; started++)
+    {
+        workers[started].scan = &scan;
+        workers[started].idx = started;
+        if (pthread_create(&workers[started].thread, NULL, castle_scan_worker_run, &workers[started]))
+        {
+            castle_scan_stop(&scan, -EAGAIN);
+            break;
+        }
+    }
+
+    /* An ordered scan can't pass a worker that was never started. */
+    if (started < scan.nr_workers && (scan_flags & CASTLE_SCAN_ORDERED))
+        castle_scan_stop(&scan, -EAGAIN);
+
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    err = scan.err;
+
+    pthread_cond_destroy(&scan.cond);
+    pthread_mutex_destroy(&scan.lock);
+out0:
+    free(split_bytes);
+    free(scan.bounds);
+    free(workers);
+
+    return err;
+}
+
+/*
+ * Keys-only scans.  These iterate with CASTLE_RING_FLAG_ITER_NO_VALUES so no
+ * values cross the ring, in the largest buffers the ring takes, and walk the
+ * keys in place through a cursor rather than copying them out.
+ */
+static int castle_scan_keys_common(castle_connection *conn,
+                                   c_collection_id_t collection,
+                                   castle_key *start_key,
+                                   castle_key *end_key,
+                                   castle_key_fn callback,
+                                   void *userdata,
+                                   uint64_t *count_out)
+{
+    struct castle_key_value_list *kv;
+    castle_cursor *cursor;
+    uint64_t count = 0;
+    int ret, err;
+
+    err = castle_cursor_start(conn, collection, start_key, end_key, castle_max_buffer_size(),
+                              CASTLE_RING_FLAG_ITER_NO_VALUES, &cursor);
+    if (err)
+        return err;
+
+    err = castle_cursor_prefetch(cursor, 2);
+    if (err)
+        goto out;
+
+    while ((err = castle_cursor_next(cursor, &kv)) > 0)
+    {
+        count++;
+        if (callback && (ret = callback(kv->key, userdata)))
+        {
+            err = ret < 0 ? ret : 0;
+            break;
+        }
+    }
+
+out:
+    ret = castle_cursor_finish(cursor);
+    if (!err)
+        err = ret;
+    if (!err && count_out)
+        *count_out = count;
+
+    return err;
+}
+
+/**
+ * Call callback for each key in [start_key, end_key], without fetching values.
+ *
+ * @param   callback    Called with each key, which is only valid during the call.
+ *                      A non-zero return stops the scan; a negative one is also
+ *                      returned as the error.
+ */
+int castle_scan_keys(castle_connection *conn,
+                     c_collection_id_t collection,
+                     castle_key *start_key,
+                     castle_key *end_key,
+                     castle_key_fn callback,
+                     void *userdata)
+{
+    return castle_scan_keys_common(conn, collection, start_key, end_key, callback, userdata, NULL);
+}
+
+/**
+ * Count the keys in [start_key, end_key], without fetching values.
+ */
+int castle_count_range(castle_connection *conn,
+                       c_collection_id_t collection,
+                       castle_key *start_key,
+                       castle_key *end_key,
+                       uint64_t *count_out)
+{
+    return castle_scan_keys_common(conn, collection, start_key, end_key, NULL, NULL, count_out);
+}
+
+/*
+ * Hyper-rectangle queries.
+ *
+ * The box is given by two keys of the same number of dimensions, lo and hi,
+ * and holds the keys whose every dimension i lies in [lo_i, hi_i]; the
+ * infinity flags leave a side of a dimension unbounded.  The keys between lo
+ * and hi include every key in the box, but also many outside it, so rows are
+ * checked one dimension at a time as they are read from the cursor buffer, and
+ * when a row falls outside the box the next key which could be inside it is
+ * worked out:
+ *  - if dimension i of the row is below lo_i, it is the row's first i
+ *    dimensions followed by lo's remaining ones;
+ *  - if dimension i is above hi_i, it is the row's first i - 1 dimensions,
+ *    then dimension i - 1 of the row flagged KEY_DIMENSION_NEXT_FLAG, then
+ *    lo's remaining dimensions.
+ * The cursor is then sought to that key, which skips rows already fetched in
+ * place and restarts the kernel's iterator from the key past the rest.
+ */
+
+#define CASTLE_BOX_PREFETCH     2
+
+struct castle_box_query
+{
+    castle_key           *lo;
+    castle_key           *hi;
+    uint32_t              dims;
+
+    castle_key_builder    seek;
+    castle_key           *seek_key;     /**< Set by castle_box_check()                  */
+};
+
+/* Append dimensions [from, to) of key to the seek key. */
+static int castle_box_seek_append(struct castle_box_query *q, castle_key *key,
+                                  uint32_t from, uint32_t to)
+{
+    int err;
+
+    for (uint32_t i = from; i < to; i++)
+    {
+        err = castle_key_builder_append(&q->seek, castle_key_elem_data(key, i),
+                                        castle_key_elem_len(key, i),
+                                        castle_key_elem_flags(key, i));
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+/*
+ * Check key against the box.
+ *
+ * @return  0 if it is inside, 1 if it is outside and q->seek_key has been set
+ *          to the next key which could be inside, 2 if no later key can be
+ *          inside, <0 on error
+ */
+static int castle_box_check(struct castle_box_query *q, castle_key *key)
+{
+    uint32_t dims = castle_key_dims(key) < q->dims ? castle_key_dims(key) : q->dims;
+    uint32_t i, keep;
+    int err;
+
+    for (i = 0; i < dims; i++)
+    {
+        if (castle_key_elem_compare(key, i, q->lo, i) < 0)
+        {
+            keep = i;
+            break;
+        }
+        if (castle_key_elem_compare(key, i, q->hi, i) > 0)
+        {
+            if (i == 0)
+                return 2;
+            keep = i - 1;
+            break;
+        }
+    }
+    if (i == dims)
+        return 0;
+
+    if ((err = castle_key_builder_reset(&q->seek, q->dims))
+            || (err = castle_box_seek_append(q, key, 0, keep)))
+        return err;
+    if (keep < i)
+    {
+        err = castle_key_builder_append(&q->seek, castle_key_elem_data(key, keep),
+                                        castle_key_elem_len(key, keep),
+                                        castle_key_elem_flags(key, keep) | KEY_DIMENSION_NEXT_FLAG);
+        if (err)
+            return err;
+        keep++;
+    }
+    if ((err = castle_box_seek_append(q, q->lo, keep, q->dims))
+            || (err = castle_key_builder_finish(&q->seek, &q->seek_key, NULL)))
+        return err;
+
+    return castle_key_compare(q->seek_key, q->hi) > 0 ? 2 : 1;
+}
+
+/**
+ * Call callback for each key in the box with corners lo and hi, see above.
+ *
+ * @param   flags       CASTLE_RING_FLAG_* for the iterator, e.g.
+ *                      CASTLE_RING_FLAG_ITER_NO_VALUES
+ * @param   callback    Called with each entry in the box, which is only valid
+ *                      during the call.  A non-zero return stops the query; a
+ *                      negative one is also returned as the error.
+ * @param   [out]       restarts_out    If not NULL, how many times the
+ *                                      iterator was moved on past rows outside
+ *                                      the box
+ */
+int castle_box_query(castle_connection *conn,
+                     c_collection_id_t collection,
+                     castle_key *lo,
+                     castle_key *hi,
+                     uint8_t flags,
+                     castle_kv_fn callback,
+                     void *userdata,
+                     uint64_t *restarts_out)
+{
+    struct castle_box_query q;
+    struct castle_key_value_list *kv;
+    castle_cursor *cursor = NULL;
+    uint64_t restarts = 0;
+    int ret, err;
+
+    if (castle_key_dims(lo) != castle_key_dims(hi) || castle_key_dims(lo) == 0)
+        return -EINVAL;
+
+    memset(&q, 0, sizeof(q));
+    q.lo = lo;
+    q.hi = hi;
+    q.dims = castle_key_dims(lo);
+
+    err = castle_key_builder_init(&q.seek, NULL, castle_key_length(hi) + castle_key_length(lo));
+    if (err)
+        return err;
+
+    err = castle_cursor_start(conn, collection, lo, hi, castle_max_buffer_size(), flags, &cursor);
+    if (err)
+        goto out;
+
+    err = castle_cursor_prefetch(cursor, CASTLE_BOX_PREFETCH);
+    if (err)
+        goto out;
+
+    while ((err = castle_cursor_next(cursor, &kv)) > 0)
+    {
+        ret = castle_box_check(&q, kv->key);
+        if (ret == 1)
+        {
+            /* Outside; move on to the next key which could be inside. */
+            restarts++;
+            if ((err = castle_cursor_seek(cursor, q.seek_key)))
+                break;
+            continue;
+        }
+        if (ret)
+        {
+            err = ret < 0 ? ret : 0;
+            break;
+        }
+
+        if ((ret = callback(kv, userdata)))
+        {
+            err = ret < 0 ? ret : 0;
+            break;
+        }
+    }
+
+out:
+    ret = castle_cursor_finish(cursor);
+    if (!err)
+        err = ret;
+    castle_key_builder_destroy(&q.seek);
+    if (!err && restarts_out)
+        *restarts_out = restarts;
+
+    return err;
+}
+
+/*
+ * Prefix scans.
+ *
+ * A prefix is given as a key of the collection's full number of dimensions, of
+ * which the first nr_fixed are matched.  The scan runs from the prefix followed
+ * by minus infinity in every other dimension to the prefix followed by plus
+ * infinity, so the iterator ends exactly at the last key with the prefix.
+ *
+ * castle_prefix_scan_multi() keeps up to CASTLE_PREFIX_WINDOW iterators going
+ * at once: the ITER_STARTs for the next prefixes are sent before the current
+ * one is read, and each cursor prefetches its next batch, so short prefixes
+ * cost little more than one round trip between them.
+ *
+ * Every iterator starts with a page-sized buffer, which is all a short prefix
+ * needs, and its cursor doubles its buffers with each batch that has more
+ * entries, up to castle_max_buffer_size(), as castle_getslice() does.
+ */
+
+#define CASTLE_PREFIX_WINDOW    8
+
+/* Build the key with prefix's first nr_fixed dimensions and flags in the rest. */
+static int castle_prefix_bound(castle_key_builder *builder, castle_key *prefix,
+                               uint32_t nr_fixed, uint8_t flags, castle_key **key_out)
+{
+    uint32_t dims = castle_key_dims(prefix);
+    int err;
+
+    if ((err = castle_key_builder_reset(builder, dims)))
+        return err;
+
+    for (uint32_t i = 0; i < dims; i++)
+    {
+        if (i < nr_fixed)
+            err = castle_key_builder_append(builder, castle_key_elem_data(prefix, i),
+                                            castle_key_elem_len(prefix, i),
+                                            castle_key_elem_flags(prefix, i));
+        else
+            err = castle_key_builder_append(builder, "", 0, flags);
+        if (err)
+            return err;
+    }
+
+    return castle_key_builder_finish(builder, key_out, NULL);
+}
+
+/* Send the ITER_START for the keys matching the first nr_fixed dimensions of prefix. */
+static int castle_prefix_cursor_submit(castle_connection *conn,
+                                       c_collection_id_t collection,
+                                       castle_key *prefix,
+                                       uint32_t nr_fixed,
+                                       uint32_t buf_size,
+                                       uint8_t flags,
+                                       castle_cursor **cursor_out)
+{
+    castle_key_builder start, end;
+    castle_key *start_key, *end_key;
+    int err;
+
+    if (nr_fixed > castle_key_dims(prefix))
+        return -EINVAL;
+
+    if ((err = castle_key_builder_init(&start, NULL, castle_key_length(prefix))))
+        return err;
+    if ((err = castle_key_builder_init(&end, NULL, castle_key_length(prefix))))
+        goto out;
+
+    if (!(err = castle_prefix_bound(&start, prefix, nr_fixed, KEY_DIMENSION_MINUS_INFINITY_FLAG, &start_key))
+            && !(err = castle_prefix_bound(&end, prefix, nr_fixed, KEY_DIMENSION_PLUS_INFINITY_FLAG, &end_key)))
+        err = castle_cursor_start_submit(conn, collection, start_key, end_key, buf_size, flags, cursor_out);
+
+    castle_key_builder_destroy(&end);
+out:
+    castle_key_builder_destroy(&start);
+
+    return err;
+}
+
+/* Wait for a cursor's ITER_START, then read it to the end or until stopped. */
+static int castle_prefix_cursor_run(castle_cursor *cursor,
+                                    unsigned int index,
+                                    castle_prefix_fn callback,
+                                    void *userdata)
+{
+    struct castle_key_value_list *kv;
+    int ret, err;
+
+    err = castle_cursor_start_wait(cursor);
+    if (err)
+        return err;
+
+    err = castle_cursor_prefetch(cursor, 2);
+    if (!err)
+        err = castle_cursor_grow(cursor, castle_max_buffer_size());
+    if (err)
+        goto out;
+
+    while ((err = castle_cursor_next(cursor, &kv)) > 0)
+    {
+        if ((ret = callback(index, kv, userdata)))
+        {
+            err = ret < 0 ? ret : 0;
+            break;
+        }
+    }
+
+out:
+    ret = castle_cursor_finish(cursor);
+    if (!err)
+        err = ret;
+
+    return err;
+}
+
+/**
+ * Call callback for each key whose first nr_fixed dimensions equal those of
+ * prefix, see above.
+ *
+ * @param   flags       CASTLE_RING_FLAG_* for the iterator
+ * @param   callback    Called with index 0 and each entry, which is only valid
+ *                      during the call.  A non-zero return stops the scan; a
+ *                      negative one is also returned as the error.
+ */
+int castle_prefix_scan(castle_connection *conn,
+                       c_collection_id_t collection,
+                       castle_key *prefix,
+                       uint32_t nr_fixed,
+                       uint8_t flags,
+                       castle_prefix_fn callback,
+                       void *userdata)
+{
+    castle_cursor *cursor;
+    int err;
+
+    err = castle_prefix_cursor_submit(conn, collection, prefix, nr_fixed,
+                                      PAGE_SIZE, flags, &cursor);
+    if (err)
+        return err;
+
+    return castle_prefix_cursor_run(cursor, 0, callback, userdata);
+}
+
+/**
+ * castle_prefix_scan() for each of nr_prefixes prefixes in turn, with the
+ * iterators pipelined.  Entries are delivered prefix by prefix, in the order
+ * given, with the index of their prefix.
+ */
+int castle_prefix_scan_multi(castle_connection *conn,
+                             c_collection_id_t collection,
+                             castle_key **prefixes,
+                             unsigned int nr_prefixes,
+                             uint32_t nr_fixed,
+                             uint8_t flags,
+                             castle_prefix_fn callback,
+                             void *userdata)
+{
+    castle_cursor *window[CASTLE_PREFIX_WINDOW] = { NULL };
+    unsigned int next = 0, i;
+    int err = 0;
+
+    for (i = 0; i < nr_prefixes; i++)
+    {
+        /* Keep the window full. */
+        for (; !err && next < nr_prefixes && next < i + CASTLE_PREFIX_WINDOW; next++)
+            err = castle_prefix_cursor_submit(conn, collection, prefixes[next], nr_fixed,
+                                              PAGE_SIZE, flags,
+                                              &window[next % CASTLE_PREFIX_WINDOW]);
+        if (err)
+            break;
+
+        err = castle_prefix_cursor_run(window[i % CASTLE_PREFIX_WINDOW], i, callback, userdata);
+        window[i % CASTLE_PREFIX_WINDOW] = NULL;
+        if (err)
+            break;
+    }
+
+    /* Tidy up iterators started for prefixes not reached. */
+    for (i = 0; i < CASTLE_PREFIX_WINDOW; i++)
+        if (window[i] && castle_cursor_start_wait(window[i]) == 0)
+            castle_cursor_finish(window[i]);
+
+    return err;
+}
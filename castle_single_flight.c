@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "castle.h"
+#include "castle_private.h"
+
+/*
+ * Single-flight castle_get().
+ *
+ * Once enabled, a castle_get() that has to go to the kernel first looks for a
+ * get of the same (collection, key) already in flight from any connection in
+ * the process.  If there is one it waits for that get's result and returns a
+ * copy of it, rather than sending a request of its own; otherwise it registers
+ * its own get as the flight for the key and sends it.  A stampede on a hot key
+ * thus costs one request per round trip, not one per thread.
+ *
+ * A flight must not be joined by a get issued after a write to the key has
+ * completed, or that get could return the value from before the write.  Writes
+ * made through libcastle call castle_single_flight_forget(), which takes the
+ * key's flight out of the table; gets already waiting on it still get its
+ * result, but later gets start a new flight.
+ */
+
+#define CASTLE_FLIGHT_SHARDS    16
+#define CASTLE_FLIGHT_BUCKETS   256     /* per shard */
+
+struct castle_flight
+{
+    struct castle_flight    *next;
+    c_collection_id_t        collection;
+    uint32_t                 hash;
+    castle_key              *key;       /**< The leader's key, valid while in the table */
+    pthread_cond_t           cond;
+    int                      refs;      /**< Leader plus waiters                        */
+    int                      done;
+    int                      err;
+    char                    *value;
+    uint32_t                 value_len;
+};
+
+struct castle_flight_shard
+{
+    pthread_mutex_t          lock;
+    struct castle_flight    *buckets[CASTLE_FLIGHT_BUCKETS];
+};
+
+struct castle_flight_table
+{
+    struct castle_flight_shard      shards[CASTLE_FLIGHT_SHARDS];
+    struct castle_single_flight_stats stats;
+};
+
+static struct castle_flight_table *flights;
+
+static struct castle_flight **castle_flight_bucket(struct castle_flight_shard *shard, uint32_t hash)
+{
+    return &shard->buckets[(hash / CASTLE_FLIGHT_SHARDS) % CASTLE_FLIGHT_BUCKETS];
+}
+
+/* Take flight out of the table, if it is still there.  Called with the shard lock held. */
+static void castle_flight_unlink(struct castle_flight_shard *shard, struct castle_flight *flight)
+{
+    struct castle_flight **p;
+
+    for (p = castle_flight_bucket(shard, flight->hash); *p; p = &(*p)->next)
+        if (*p == flight)
+        {
+            *p = flight->next;
+            break;
+        }
+}
+
+/* Drop a reference to flight.  Called with the shard lock held. */
+static void castle_flight_put(struct castle_flight *flight)
+{
+    if (--flight->refs)
+        return;
+
+    pthread_cond_destroy(&flight->cond);
+    free(flight->value);
+    free(flight);
+}
+
+/**
+ * Coalesce concurrent identical castle_get() calls, see above.
+ *
+ * Not safe against concurrent castle_get() calls.
+ */
+int castle_single_flight_enable(void)
+{
+    struct castle_flight_table *table;
+
+    if (flights)
+        return -EEXIST;
+
+    table = calloc(1, sizeof(*table));
+    if (!table)
+        return -ENOMEM;
+
+    for (int i = 0; i < CASTLE_FLIGHT_SHARDS; i++)
+        pthread_mutex_init(&table->shards[i].lock, NULL);
+
+    flights = table;
+
+    return 0;
+}
+
+/**
+ * Stop coalescing gets.  Not safe against concurrent castle_get() calls.
+ */
+void castle_single_flight_disable(void)
+{
+    struct castle_flight_table *table = flights;
+
+    if (!table)
+        return;
+
+    flights = NULL;
+
+    for (int i = 0; i < CASTLE_FLIGHT_SHARDS; i++)
+        pthread_mutex_destroy(&table->shards[i].lock);
+
+    free(table);
+}
+
+void castle_single_flight_stats_get(struct castle_single_flight_stats *stats)
+{
+    struct castle_flight_table *table = flights;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!table)
+        return;
+
+    stats->fetches   = __sync_fetch_and_add(&table->stats.fetches, 0);
+    stats->coalesced = __sync_fetch_and_add(&table->stats.coalesced, 0);
+}
+
+int castle_single_flight_enabled(void)
+{
+    return flights != NULL;
+}
+
+/**
+ * castle_get() through the flight table: join the flight for key, or become
+ * it and fetch the value with castle_get_fetch().
+ */
+int castle_single_flight_get(castle_connection *conn,
+                             c_collection_id_t collection,
+                             castle_key *key,
+                             uint64_t cache_gen,
+                             char **value_out,
+                             uint32_t *value_len_out)
+{
+    struct castle_flight_table *table = flights;
+    uint32_t hash = castle_key_hash(key, collection);
+    struct castle_flight_shard *shard = &table->shards[hash % CASTLE_FLIGHT_SHARDS];
+    struct castle_flight **p, *flight;
+    char *value = NULL;
+    uint32_t value_len = 0;
+    int err;
+
+    pthread_mutex_lock(&shard->lock);
+    for (p = castle_flight_bucket(shard, hash); (flight = *p); p = &flight->next)
+        if (flight->hash == hash && flight->collection == collection
+                && castle_key_compare(flight->key, key) == 0)
+            break;
+
+    if (flight)
+    {
+        /* Wait for the get in flight and copy its result. */
+        flight->refs++;
+        while (!flight->done)
+            pthread_cond_wait(&flight->cond, &shard->lock);
+
+        err = flight->err;
+        if (!err)
+        {
+            *value_out = malloc(flight->value_len ? flight->value_len : 1);
+            if (!*value_out)
+                err = -ENOMEM;
+            else
+            {
+                memcpy(*value_out, flight->value, flight->value_len);
+                *value_len_out = flight->value_len;
+            }
+        }
+        castle_flight_put(flight);
+        pthread_mutex_unlock(&shard->lock);
+
+        __sync_fetch_and_add(&table->stats.coalesced, 1);
+
+        return err;
+    }
+
+    flight = calloc(1, sizeof(*flight));
+    if (!flight)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        return -ENOMEM;
+    }
+    flight->collection = collection;
+    flight->hash = hash;
+    flight->key = key;
+    flight->refs = 1;
+    pthread_cond_init(&flight->cond, NULL);
+    *p = flight;
+    pthread_mutex_unlock(&shard->lock);
+
+    __sync_fetch_and_add(&table->stats.fetches, 1);
+
+    err = castle_get_fetch(conn, collection, key, cache_gen, &value, &value_len);
+
+    pthread_mutex_lock(&shard->lock);
+    castle_flight_unlink(shard, flight);
+    flight->done = 1;
+    flight->err = err;
+
+    if (!err && flight->refs > 1)
+    {
+        /* The waiters copy from the flight's value, so the caller gets its own. */
+        flight->value = value;
+        flight->value_len = value_len;
+        value = malloc(value_len ? value_len : 1);
+        if (value)
+            memcpy(value, flight->value, value_len);
+        else
+            err = -ENOMEM;
+    }
+    if (!err)
+    {
+        *value_out = value;
+        *value_len_out = value_len;
+    }
+
+    pthread_cond_broadcast(&flight->cond);
+    castle_flight_put(flight);
+    pthread_mutex_unlock(&shard->lock);
+
+    return err;
+}
+
+/**
+ * Stop gets issued from now on joining the flight for key, if there is one.
+ */
+void castle_single_flight_forget(c_collection_id_t collection, castle_key *key)
+{
+    struct castle_flight_table *table = flights;
+    struct castle_flight_shard *shard;
+    struct castle_flight *flight;
+    uint32_t hash;
+
+    if (!table)
+        return;
+
+    hash = castle_key_hash(key, collection);
+    shard = &table->shards[hash % CASTLE_FLIGHT_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    for (flight = *castle_flight_bucket(shard, hash); flight; flight = flight->next)
+        if (flight->hash == hash && flight->collection == collection
+                && castle_key_compare(flight->key, key) == 0)
+        {
+            castle_flight_unlink(shard, flight);
+            break;
+        }
+    pthread_mutex_unlock(&shard->lock);
+}
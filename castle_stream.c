@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "castle.h"
+#include "castle_private.h"
+
+/*
+ * Bulk loading through the STREAM_IN ring operations.
+ *
+ * Records are packed back to back into shared buffers as a
+ * c_stream_entry_hdr followed by the key and then the value.  A buffer is
+ * sent with STREAM_IN_NEXT as soon as the next record doesn't fit, and the
+ * loader moves on to the next of CASTLE_BULK_LOAD_DEPTH buffers, so that up to
+ * that many batches are with the kernel while the caller fills another.  A
+ * record must fit in a single buffer.
+ *
+ * Values larger than MAX_INLINE_VAL_SIZE are written by the kernel as medium
+ * objects, into the medium_object_chunks reserved by STREAM_IN_START.  The
+ * loader keeps count of the space they take and refuses a record which would
+ * overrun the reservation, rather than let the kernel fail part way through.
+ */
+
+#define CASTLE_BULK_LOAD_DEPTH      4
+/* Size of the chunks medium objects are allocated from, the kernel's C_CHK_SIZE. */
+#define CASTLE_STREAM_CHUNK_SIZE    (1024 * 1024)
+/* Medium objects are allocated in whole pages. */
+#define CASTLE_STREAM_CHUNK_PAGES   (CASTLE_STREAM_CHUNK_SIZE / PAGE_SIZE)
+
+struct castle_bulk_loader
+{
+    castle_connection            *conn;
+    castle_token                  token;
+    uint32_t                      buf_size;
+
+    char                         *bufs[CASTLE_BULK_LOAD_DEPTH];
+    struct castle_blocking_call   calls[CASTLE_BULK_LOAD_DEPTH];
+    int                           busy[CASTLE_BULK_LOAD_DEPTH];
+    unsigned int                  curr;     /**< Buffer being filled                        */
+    uint32_t                      used;     /**< Bytes packed into bufs[curr]               */
+
+    uint64_t                      medium_pages;     /**< Pages used by medium objects so far */
+    uint64_t                      medium_pages_max; /**< Pages reserved at start             */
+    int                           err;      /**< Sticky error from a STREAM_IN_NEXT         */
+};
+
+/**
+ * Number of pages a value takes up in the medium object chunks; 0 for values
+ * stored inline.
+ */
+uint64_t castle_bulk_load_value_pages(uint64_t value_len)
+{
+    if (value_len <= MAX_INLINE_VAL_SIZE)
+        return 0;
+
+    return (value_len + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+/**
+ * Number of medium_object_chunks to reserve for values taking up pages in
+ * total, as summed from castle_bulk_load_value_pages().
+ */
+uint32_t castle_bulk_load_chunks(uint64_t pages)
+{
+    return (pages + CASTLE_STREAM_CHUNK_PAGES - 1) / CASTLE_STREAM_CHUNK_PAGES;
+}
+
+/* Wait for the STREAM_IN_NEXT using buffer idx, if any. */
+static int castle_bulk_load_reap(castle_bulk_loader *loader, unsigned int idx)
+{
+    int err;
+
+    if (!loader->busy[idx])
+        return 0;
+
+    err = castle_request_wait(loader->conn, &loader->calls[idx]);
+    loader->busy[idx] = 0;
+    if (err && !loader->err)
+        loader->err = err;
+
+    return loader->err;
+}
+
+/* Send the buffer being filled and move on to the next, once it is free. */
+static int castle_bulk_load_flush(castle_bulk_loader *loader)
+{
+    castle_request_t req;
+    unsigned int idx = loader->curr;
+
+    if (loader->used == 0)
+        return loader->err;
+
+    castle_stream_in_next_prepare(&req, loader->token, loader->bufs[idx], loader->used,
+                                  CASTLE_RING_FLAG_NONE);
+    castle_request_submit(loader->conn, &req, &loader->calls[idx], 1);
+    loader->busy[idx] = 1;
+
+    loader->curr = (idx + 1) % CASTLE_BULK_LOAD_DEPTH;
+    loader->used = 0;
+
+    return castle_bulk_load_reap(loader, loader->curr);
+}
+
+static void castle_bulk_load_free(castle_bulk_loader *loader)
+{
+    for (unsigned int i = 0; i < CASTLE_BULK_LOAD_DEPTH; i++)
+        if (loader->bufs[i])
+            castle_shared_buffer_put(loader->conn, loader->bufs[i], loader->buf_size);
+
+    free(loader);
+}
+
+/**
+ * Start a bulk load of entries_count sorted records into collection.
+ *
+ * @param   medium_object_chunks    Chunks to reserve for values stored out of
+ *                                  line, see castle_bulk_load_chunks()
+ */
+int castle_bulk_load_start(castle_connection *conn,
+                           c_collection_id_t collection,
+                           uint64_t entries_count,
+                           uint32_t medium_object_chunks,
+                           castle_bulk_loader **loader_out)
+{
+    struct castle_blocking_call call;
+    castle_bulk_loader *loader;
+    castle_request_t req;
+    int err;
+
+    *loader_out = NULL;
+
+    /* Not buffered, but must follow earlier buffered writes. */
+    err = castle_write_behind_flush(conn);
+    if (err)
+        return err;
+
+    loader = calloc(1, sizeof(*loader));
+    if (!loader)
+        return -ENOMEM;
+    loader->conn = conn;
+    loader->buf_size = castle_max_buffer_size();
+    loader->medium_pages_max = (uint64_t)medium_object_chunks * CASTLE_STREAM_CHUNK_PAGES;
+
+    for (unsigned int i = 0; i < CASTLE_BULK_LOAD_DEPTH; i++)
+    {
+        err = castle_shared_buffer_get(conn, loader->buf_size, &loader->bufs[i]);
+        if (err)
+            goto err;
+    }
+
+    castle_stream_in_start_prepare(&req, collection, entries_count, medium_object_chunks,
+                                   CASTLE_RING_FLAG_NONE);
+
+    err = castle_request_do_blocking(conn, &req, &call);
+    if (err)
+        goto err;
+
+    loader->token = call.token;
+    *loader_out = loader;
+
+    return 0;
+
+err:
+    castle_bulk_load_free(loader);
+    return err;
+}
+
+/**
+ * Add a record to a bulk load.  Records must be added in key order.
+ *
+ * @param   type    CASTLE_STREAMING_ENTRY_HEADER_TYPE_*
+ *
+ * @return -EFBIG   The record doesn't fit in a stream buffer
+ * @return -ENOSPC  The value would overrun the medium object chunks reserved
+ */
+int castle_bulk_load_add(castle_bulk_loader *loader,
+                         castle_key *key,
+                         const char *value,
+                         uint64_t value_len,
+                         castle_user_timestamp_t timestamp,
+                         uint8_t type)
+{
+    uint32_t key_len = castle_key_buffer_len(key);
+    uint64_t pages = castle_bulk_load_value_pages(value_len);
+    uint64_t rec_len = sizeof(c_stream_entry_hdr) + key_len + value_len;
+    c_stream_entry_hdr *hdr;
+    char *p;
+    int err;
+
+    if (loader->err)
+        return loader->err;
+
+    if (rec_len > loader->buf_size)
+        return -EFBIG;
+
+    if (loader->medium_pages + pages > loader->medium_pages_max)
+        return -ENOSPC;
+
+    if (loader->used + rec_len > loader->buf_size)
+    {
+        err = castle_bulk_load_flush(loader);
+        if (err)
+            return err;
+    }
+
+    p = loader->bufs[loader->curr] + loader->used;
+    hdr = (c_stream_entry_hdr *)p;
+    hdr->type = type;
+    hdr->timestamp = timestamp;
+    hdr->key_length = key_len;
+    hdr->val_length = value_len;
+    p += sizeof(*hdr);
+
+    castle_key_buffer_fill(key, p, key_len);
+    p += key_len;
+
+    if (value_len)
+        memcpy(p, value, value_len);
+
+    loader->used += rec_len;
+    loader->medium_pages += pages;
+
+    return 0;
+}
+
+/**
+ * Complete a bulk load, or abort it if abort is set or a batch failed.  The
+ * loader is freed either way.
+ *
+ * @return  The first error met by the load, if any
+ */
+int castle_bulk_load_finish(castle_bulk_loader *loader, int abort)
+{
+    struct castle_blocking_call call;
+    castle_request_t req;
+    int err = 0, ret;
+
+    if (!abort)
+        err = castle_bulk_load_flush(loader);
+
+    for (unsigned int i = 0; i < CASTLE_BULK_LOAD_DEPTH; i++)
+    {
+        ret = castle_bulk_load_reap(loader, i);
+        if (!err)
+            err = ret;
+    }
+
+    if (abort || err)
+        castle_stream_in_abort_prepare(&req, loader->token, CASTLE_RING_FLAG_NONE);
+    else
+        castle_stream_in_finish_prepare(&req, loader->token, CASTLE_RING_FLAG_NONE);
+
+    ret = castle_request_do_blocking(loader->conn, &req, &call);
+    if (!err)
+        err = ret;
+
+    castle_bulk_load_free(loader);
+
+    return err;
+}
@@ -0,0 +1,443 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "castle.h"
+#include "castle_private.h"
+
+/*
+ * Write-behind for castle_replace() and castle_remove().
+ *
+ * Once enabled on a connection, replaces and removes are not sent straight
+ * away but recorded in a table holding the latest write for each key, so
+ * repeated writes to a key cost one request.  A flusher thread moves the whole
+ * table aside and writes it out with castle_write_multi_send() every max_delay_ms,
+ * or sooner once max_keys keys or max_bytes of values are pending.
+ *
+ * castle_get() on the connection looks in the pending table, then in the
+ * table being flushed, before asking the kernel, so a connection always reads
+ * its own writes; castle_get_multi() and castle_big_get() flush first.  So do
+ * castle_big_put() and castle_bulk_load_start(), which are never buffered.  castle_write_behind_flush() is a barrier after which every
+ * earlier write has been applied.  Timestamped writes are not buffered; they
+ * flush first so that they are ordered after earlier buffered writes.
+ *
+ * The async calls follow the same rules: castle_replace_async() and
+ * castle_remove_async() are buffered and complete at once, castle_get_async()
+ * completes at once from a buffered write to its key, and the timestamped
+ * variants flush first if a write to their key is buffered.
+ */
+
+#define CASTLE_WB_BUCKETS       1024
+#define CASTLE_WB_FLUSH_BATCH   256
+
+struct castle_wb_entry
+{
+    struct castle_wb_entry  *next;
+    c_collection_id_t        collection;
+    uint32_t                 hash;
+    uint8_t                  type;          /**< CASTLE_WRITE_REPLACE or _REMOVE            */
+    castle_key              *key;           /**< Copy of the key, following the entry       */
+    char                    *value;         /**< Copy of the value, following the key       */
+    uint32_t                 value_len;
+};
+
+struct castle_wb_table
+{
+    struct castle_wb_entry  *buckets[CASTLE_WB_BUCKETS];
+    unsigned int             nr;
+    uint64_t                 bytes;
+};
+
+struct castle_write_behind
+{
+    unsigned int             max_keys;
+    uint64_t                 max_bytes;
+    unsigned int             max_delay_ms;
+
+    pthread_mutex_t          lock;
+    pthread_cond_t           cond;
+    struct castle_wb_table  *pending;       /**< Writes not yet being flushed               */
+    struct castle_wb_table  *flushing;      /**< Writes being flushed, or NULL              */
+
+    pthread_mutex_t          flush_lock;    /**< Serialises flushes                         */
+    pthread_t                flusher;
+    int                      kick;
+    int                      exit;
+    int                      err;           /**< First error from a background flush        */
+};
+
+static struct castle_wb_entry **castle_wb_find(struct castle_wb_table *table,
+                                               c_collection_id_t collection,
+                                               castle_key *key, uint32_t hash)
+{
+    struct castle_wb_entry **p = &table->buckets[hash % CASTLE_WB_BUCKETS];
+
+    for (; *p; p = &(*p)->next)
+        if ((*p)->hash == hash && (*p)->collection == collection
+                && castle_key_compare((*p)->key, key) == 0)
+            break;
+
+    return p;
+}
+
+static void castle_wb_table_free(struct castle_wb_table *table)
+{
+    struct castle_wb_entry *entry, *next;
+
+    for (unsigned int b = 0; b < CASTLE_WB_BUCKETS; b++)
+        for (entry = table->buckets[b]; entry; entry = next)
+        {
+            next = entry->next;
+            free(entry);
+        }
+
+    free(table);
+}
+
+/* Write out the flushing table.  Called with flush_lock held. */
+static int castle_wb_write(castle_connection *conn, struct castle_wb_table *table)
+{
+    struct castle_write_op ops[CASTLE_WB_FLUSH_BATCH];
+    int errs[CASTLE_WB_FLUSH_BATCH];
+    struct castle_wb_entry *entry;
+    unsigned int n = 0;
+    int err = 0, ret;
+
+    for (unsigned int b = 0; b < CASTLE_WB_BUCKETS; b++)
+    {
+        for (entry = table->buckets[b]; entry; entry = entry->next)
+        {
+            ops[n].type = entry->type;
+            ops[n].collection = entry->collection;
+            ops[n].key = entry->key;
+            ops[n].value = entry->value;
+            ops[n].value_len = entry->value_len;
+            ops[n].user_timestamp = 0;
+
+            if (++n == CASTLE_WB_FLUSH_BATCH)
+            {
+                ret = castle_write_multi_send(conn, ops, n, errs);
+                if (ret && !err)
+                    err = ret;
+                n = 0;
+            }
+        }
+    }
+
+    if (n)
+    {
+        ret = castle_write_multi_send(conn, ops, n, errs);
+        if (ret && !err)
+            err = ret;
+    }
+
+    return err;
+}
+
+static int castle_wb_flush_locked(castle_connection *conn, struct castle_write_behind *wb)
+{
+    struct castle_wb_table *table, *fresh;
+    int err;
+
+    fresh = calloc(1, sizeof(*fresh));
+    if (!fresh)
+        return -ENOMEM;
+
+    pthread_mutex_lock(&wb->lock);
+    table = wb->pending;
+    if (table->nr == 0)
+    {
+        pthread_mutex_unlock(&wb->lock);
+        free(fresh);
+        return 0;
+    }
+    wb->pending = fresh;
+    wb->flushing = table;
+    pthread_mutex_unlock(&wb->lock);
+
+    err = castle_wb_write(conn, table);
+
+    pthread_mutex_lock(&wb->lock);
+    wb->flushing = NULL;
+    pthread_mutex_unlock(&wb->lock);
+
+    castle_wb_table_free(table);
+
+    return err;
+}
+
+static void *castle_wb_flusher(void *data)
+{
+    castle_connection *conn = data;
+    struct castle_write_behind *wb = conn->write_behind;
+    struct timespec deadline;
+    int stop, err;
+
+    for (;;)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wb->max_delay_ms / 1000;
+        deadline.tv_nsec += (wb->max_delay_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&wb->lock);
+        while (!wb->kick && !wb->exit
+                && pthread_cond_timedwait(&wb->cond, &wb->lock, &deadline) != ETIMEDOUT);
+        wb->kick = 0;
+        stop = wb->exit;
+        pthread_mutex_unlock(&wb->lock);
+
+        if (stop)
+            break;
+
+        pthread_mutex_lock(&wb->flush_lock);
+        err = castle_wb_flush_locked(conn, wb);
+        pthread_mutex_unlock(&wb->flush_lock);
+
+        if (err)
+        {
+            pthread_mutex_lock(&wb->lock);
+            if (!wb->err)
+                wb->err = err;
+            pthread_mutex_unlock(&wb->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Buffer replaces and removes on conn, see above.
+ *
+ * @param   max_keys        Flush once this many keys are pending
+ * @param   max_bytes       Flush once this many bytes of values are pending
+ * @param   max_delay_ms    Flush at least this often
+ */
+int castle_write_behind_enable(castle_connection *conn,
+                               unsigned int max_keys,
+                               uint64_t max_bytes,
+                               unsigned int max_delay_ms)
+{
+    struct castle_write_behind *wb;
+
+    if (conn->write_behind)
+        return -EEXIST;
+    if (max_keys == 0 || max_bytes == 0 || max_delay_ms == 0)
+        return -EINVAL;
+
+    wb = calloc(1, sizeof(*wb));
+    if (!wb)
+        return -ENOMEM;
+    wb->pending = calloc(1, sizeof(*wb->pending));
+    if (!wb->pending)
+    {
+        free(wb);
+        return -ENOMEM;
+    }
+
+    wb->max_keys = max_keys;
+    wb->max_bytes = max_bytes;
+    wb->max_delay_ms = max_delay_ms;
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->cond, NULL);
+    pthread_mutex_init(&wb->flush_lock, NULL);
+
+    conn->write_behind = wb;
+    if (pthread_create(&wb->flusher, NULL, castle_wb_flusher, conn))
+    {
+        conn->write_behind = NULL;
+        pthread_mutex_destroy(&wb->flush_lock);
+        pthread_cond_destroy(&wb->cond);
+        pthread_mutex_destroy(&wb->lock);
+        free(wb->pending);
+        free(wb);
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+/**
+ * Apply every buffered write made on conn before the call.
+ *
+ * @return  The first error from this or an earlier background flush
+ */
+int castle_write_behind_flush(castle_connection *conn)
+{
+    struct castle_write_behind *wb = conn->write_behind;
+    int err;
+
+    if (!wb)
+        return 0;
+
+    pthread_mutex_lock(&wb->flush_lock);
+    err = castle_wb_flush_locked(conn, wb);
+    pthread_mutex_unlock(&wb->flush_lock);
+
+    pthread_mutex_lock(&wb->lock);
+    if (!err)
+        err = wb->err;
+    wb->err = 0;
+    pthread_mutex_unlock(&wb->lock);
+
+    return err;
+}
+
+/**
+ * Flush and stop buffering writes on conn.
+ */
+int castle_write_behind_disable(castle_connection *conn)
+{
+    struct castle_write_behind *wb = conn->write_behind;
+    int err;
+
+    if (!wb)
+        return 0;
+
+    pthread_mutex_lock(&wb->lock);
+    wb->exit = 1;
+    pthread_cond_signal(&wb->cond);
+    pthread_mutex_unlock(&wb->lock);
+    pthread_join(wb->flusher, NULL);
+
+    err = castle_write_behind_flush(conn);
+
+    conn->write_behind = NULL;
+    castle_wb_table_free(wb->pending);
+    pthread_mutex_destroy(&wb->flush_lock);
+    pthread_cond_destroy(&wb->cond);
+    pthread_mutex_destroy(&wb->lock);
+    free(wb);
+
+    return err;
+}
+
+/**
+ * Record a replace or remove, replacing any pending write to the same key.
+ */
+int castle_write_behind_put(castle_connection *conn,
+                            c_collection_id_t collection,
+                            castle_key *key,
+                            const char *value,
+                            uint32_t value_len,
+                            uint8_t type)
+{
+    struct castle_write_behind *wb = conn->write_behind;
+    uint32_t hash = castle_key_hash(key, collection);
+    uint32_t key_len = castle_key_length(key);
+    struct castle_wb_entry *entry, *old, **p;
+    int kick, err;
+
+    /* Set by the flusher under wb->lock. */
+    if ((err = __sync_fetch_and_add(&wb->err, 0)))
+        return err;
+
+    entry = malloc(sizeof(*entry) + key_len + value_len);
+    if (!entry)
+        return -ENOMEM;
+    entry->collection = collection;
+    entry->hash = hash;
+    entry->type = type;
+    entry->key = (castle_key *)(entry + 1);
+    memcpy(entry->key, key, key_len);
+    entry->value = (char *)entry->key + key_len;
+    entry->value_len = value_len;
+    if (value_len)
+        memcpy(entry->value, value, value_len);
+
+    pthread_mutex_lock(&wb->lock);
+    p = castle_wb_find(wb->pending, collection, key, hash);
+    old = *p;
+    if (old)
+    {
+        entry->next = old->next;
+        wb->pending->bytes -= old->value_len;
+    }
+    else
+    {
+        entry->next = NULL;
+        wb->pending->nr++;
+    }
+    *p = entry;
+    wb->pending->bytes += value_len;
+
+    kick = wb->pending->nr >= wb->max_keys || wb->pending->bytes >= wb->max_bytes;
+    if (kick)
+    {
+        wb->kick = 1;
+        pthread_cond_signal(&wb->cond);
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    free(old);
+
+    return 0;
+}
+
+/**
+ * Look for a buffered write to key.
+ *
+ * @return  0 and a malloc()ed copy of the value if a replace is pending
+ * @return -ENOENT if a remove is pending
+ * @return  1 if nothing is pending for the key
+ */
+int castle_write_behind_get(castle_connection *conn,
+                            c_collection_id_t collection,
+                            castle_key *key,
+                            char **value_out,
+                            uint32_t *value_len_out)
+{
+    struct castle_write_behind *wb = conn->write_behind;
+    uint32_t hash = castle_key_hash(key, collection);
+    struct castle_wb_entry *entry;
+    int ret = 1;
+
+    pthread_mutex_lock(&wb->lock);
+    entry = *castle_wb_find(wb->pending, collection, key, hash);
+    if (!entry && wb->flushing)
+        entry = *castle_wb_find(wb->flushing, collection, key, hash);
+
+    if (entry && entry->type == CASTLE_WRITE_REMOVE)
+        ret = -ENOENT;
+    else if (entry)
+    {
+        ret = 0;
+        *value_out = malloc(entry->value_len ? entry->value_len : 1);
+        if (!*value_out)
+            ret = -ENOMEM;
+        else
+        {
+            memcpy(*value_out, entry->value, entry->value_len);
+            *value_len_out = entry->value_len;
+        }
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    return ret;
+}
+
+/**
+ * Is a write to key pending or being flushed?
+ */
+int castle_write_behind_pending(castle_connection *conn,
+                                c_collection_id_t collection,
+                                castle_key *key)
+{
+    struct castle_write_behind *wb = conn->write_behind;
+    uint32_t hash = castle_key_hash(key, collection);
+    int pending;
+
+    pthread_mutex_lock(&wb->lock);
+    pending = *castle_wb_find(wb->pending, collection, key, hash) != NULL
+        || (wb->flushing && *castle_wb_find(wb->flushing, collection, key, hash) != NULL);
+    pthread_mutex_unlock(&wb->lock);
+
+    return pending;
+}